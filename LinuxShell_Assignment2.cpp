@@ -6,22 +6,92 @@
 // - Pipes (|) and redirection (<, >, >>)
 // - Job control: builtins: jobs, fg, bg, cd, exit
 // - Basic signal handling (SIGCHLD, SIGINT, SIGTSTP)
+// - jsonl builtin: fast JSON-lines field extraction/filtering
+// - Opt-in shared-memory ring transport between cooperating pipeline stages
+// - rec builtin and `set -o structured`: typed record batches between builtins
+// - cache prefix: content-addressed memoization of command output
+// - tasks builtin: parallel make-style DAG runner on the job machinery
+// - watch prefix: re-run a pipeline on file changes (inotify, debounced)
+// - workers builtin: pool of worker shells that run background jobs
+// - Detachable sessions (-S/-A): jobs survive closing the terminal
+// - Crash-safe mmap'd job journal; a restarted shell re-adopts live jobs
+// - exec-upgrade: re-exec a new shell binary keeping jobs and state
+// - stats builtin: always-on latency histograms of the shell's own phases
+// - metrics builtin: OpenMetrics export to a file or Unix socket
+// - Always-on flight recorder of recent events (flightrec, SIGQUIT, crashes)
+// - USDT probes at tokenize/parse, spawn/exec, reap and job state changes
+// - jobs --profile: find the stage limiting a running pipeline
+// - profile prefix: perf_event sampling of every stage, folded-stack output
+// - shellprof builtin: CPU-time sampling of the shell process itself
+// - allocstat builtin: heap allocations per phase (-DSIMPLESHELL_ALLOCSTAT)
+// - bench prefix: repeated timed runs with rusage and outlier detection
+// - --bench-spawn: spawn latency vs. shell heap size, as CSV
+// - --record/--replay: capture a session and replay it with latency stats
+// - --bench-pty: prompt and echo latency measured through a pseudo-terminal
+// - --bench-parse: tokenizer/parser scaling check on pathological inputs
+// - SIMPLESHELL_PROMPT: templated prompt, VCS branch computed asynchronously
+// - set -o coalesce: background output relayed as job-prefixed line batches
 //
 // Notes / limitations:
 // - This is a teaching-level shell. It does not implement all edge cases
 //   of a production shell. It demonstrates core OS concepts required
 //   by the assignment.
 // - Uses POSIX APIs: fork, execvp, pipe, dup2, waitpid, setpgid, tcsetpgrp.
-// - Compile on Linux with: g++ -std=c++17 -O2 -o simpleshell LinuxShell_Assignment2.cpp
+// - Compile on Linux with: g++ -std=c++17 -O2 -pthread -o simpleshell LinuxShell_Assignment2.cpp
 
 #include <bits/stdc++.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/sendfile.h>
+#include <glob.h>
+#include <fnmatch.h>
+#include <dirent.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/ioctl.h>
+#include <sys/file.h>
+#include <sched.h>
+#include <spawn.h>
+#include <malloc.h>
+#include <elf.h>
+#include <cxxabi.h>
+#include <execinfo.h>
+#include <linux/perf_event.h>
+#include <linux/futex.h>
+#include <poll.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <signal.h>
 #include <termios.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// USDT probes (provider "simpleshell"): SDT notes when systemtap's
+// <sys/sdt.h> is available, a single nop each until a tracer attaches;
+// otherwise nothing at all.
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define SHELL_PROBE1(name, a) STAP_PROBE1(simpleshell, name, a)
+#define SHELL_PROBE2(name, a, b) STAP_PROBE2(simpleshell, name, a, b)
+#define SHELL_PROBE3(name, a, b, c) STAP_PROBE3(simpleshell, name, a, b, c)
+#endif
+#endif
+#ifndef SHELL_PROBE1
+#define SHELL_PROBE1(name, a) do {} while (0)
+#define SHELL_PROBE2(name, a, b) do {} while (0)
+#define SHELL_PROBE3(name, a, b, c) do {} while (0)
+#endif
 
 using namespace std;
 
@@ -32,17 +102,154 @@ struct Job {
     string cmdline;
     bool is_background;
     int status; // 0 running, 1 stopped, 2 done
+    vector<pid_t> pids;   // one per stage
+    int live = 0;         // stages not yet reaped
+    int exit_status = 0;  // wait status of the last stage
+    int worker = -1;      // pool worker running it (-2 queued), -1 local
+    vector<uint64_t> starts;  // stage start times, for the journal
+    vector<int> pidfds;       // set for jobs adopted from a crashed shell
+    bool coalesced = false;   // output goes through the relay (set -o coalesce)
 };
 
 static vector<Job> jobs;
 static int next_job_id = 1;
 static struct termios shell_tmodes;
 static pid_t shell_pgid;
+static volatile sig_atomic_t got_sigint = 0;  // set by sigint_handler for builtins that loop
+static atomic<uint64_t> jobs_launched_total{0}, jobs_done_total{0}, stages_spawned_total{0};   // for metrics
+static int spawn_gate[2] = { -1, -1 };   // when set, stages wait for EOF on [0] before exec
+static int spawn_out = -1;                // when set, stages send output here (set -o coalesce)
+static int last_status = 0;               // exit status of the last foreground command
 
 // Forward declarations
 void sigchld_handler(int sig);
 void sigint_handler(int sig);
 void sigtstp_handler(int sig);
+void block_sigchld(sigset_t *old);
+void wait_for_job(int id);
+void journal_job(const Job &j, int type);
+void journal_checkpoint();
+bool journal_nearly_full();
+uint64_t proc_start_time(pid_t pid);
+uint64_t boot_ticks();
+int tasks_builtin(const vector<string> &argv);
+int exec_upgrade(const vector<string> &argv);
+int metrics_builtin(const vector<string> &argv);
+void workers_poll();
+void metrics_tick();
+void metrics_shutdown();
+int job_profile(int id, double secs);
+int shellprof_builtin(const vector<string> &argv);
+void cwd_refresh();
+void coalesce_add(int fd, int jid);
+bool is_builtin(const vector<string> &argv);
+void coalesce_kick();
+void coalesce_foreground(int jid, bool on);
+void coalesce_stop();
+void prompt_stop();
+vector<pair<int,int>> coalesce_handoff();
+void record_save(ostream &o);
+void record_restore(istream &f);
+
+// ---- Allocation stats ----
+// Built with -DSIMPLESHELL_ALLOCSTAT, global operator new/delete count
+// allocations and bytes against the phase the calling thread is in
+// (ALLOC_PHASE marks a scope). Each block carries a small header naming its
+// phase, so a free is charged to the phase that allocated it. Counters start in static storage and move to
+// a shared mapping at startup so allocations made by forked children (argv
+// build) are seen too. allocstat prints them; -r resets. Without the flag
+// ALLOC_PHASE compiles away.
+
+enum { AP_OTHER, AP_TOKENIZE, AP_PARSE, AP_ARGV, AP_JOBS, AP_N };
+
+#ifdef SIMPLESHELL_ALLOCSTAT
+
+struct AllocCounters {
+    atomic<uint64_t> allocs[AP_N], bytes[AP_N], frees[AP_N];
+    atomic<uint64_t> lines;
+};
+
+static AllocCounters alloc_static;
+static AllocCounters *alloc_ctr = &alloc_static;
+static thread_local int alloc_phase = AP_OTHER;
+
+struct AllocPhase {
+    int prev;
+    explicit AllocPhase(int p): prev(alloc_phase) { alloc_phase = p; }
+    ~AllocPhase(){ alloc_phase = prev; }
+};
+#define ALLOC_PHASE(p) AllocPhase alloc_phase_scope(p)
+#define ALLOC_LINE() alloc_ctr->lines.fetch_add(1, memory_order_relaxed)
+
+// Keeps the block malloc-aligned behind it.
+static const size_t ALLOC_HDR = alignof(max_align_t);
+
+static void* counted_alloc(size_t n, bool nothrow){
+    char *p = (char*)malloc(ALLOC_HDR+n);
+    if (!p){ if (nothrow) return nullptr; throw bad_alloc(); }
+    int ph = alloc_phase;
+    *(int*)p = ph;
+    alloc_ctr->allocs[ph].fetch_add(1, memory_order_relaxed);
+    alloc_ctr->bytes[ph].fetch_add(n, memory_order_relaxed);
+    return p+ALLOC_HDR;
+}
+
+static void counted_free(void *q){
+    if (!q) return;
+    char *p = (char*)q-ALLOC_HDR;
+    alloc_ctr->frees[*(int*)p].fetch_add(1, memory_order_relaxed);
+    free(p);
+}
+
+void* operator new(size_t n){ return counted_alloc(n, false); }
+void* operator new[](size_t n){ return counted_alloc(n, false); }
+void* operator new(size_t n, const nothrow_t&) noexcept { return counted_alloc(n, true); }
+void* operator new[](size_t n, const nothrow_t&) noexcept { return counted_alloc(n, true); }
+void operator delete(void *p) noexcept { counted_free(p); }
+void operator delete[](void *p) noexcept { counted_free(p); }
+void operator delete(void *p, size_t) noexcept { counted_free(p); }
+void operator delete[](void *p, size_t) noexcept { counted_free(p); }
+void operator delete(void *p, const nothrow_t&) noexcept { counted_free(p); }
+void operator delete[](void *p, const nothrow_t&) noexcept { counted_free(p); }
+
+void allocstat_init(){
+    void *m = mmap(nullptr, sizeof(AllocCounters), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (m==MAP_FAILED) return;
+    AllocCounters *c = (AllocCounters*)m;
+    for (int p=0;p<AP_N;++p){
+        c->allocs[p].store(alloc_static.allocs[p].load()); c->bytes[p].store(alloc_static.bytes[p].load()); c->frees[p].store(alloc_static.frees[p].load());
+    }
+    alloc_ctr = c;
+}
+
+int allocstat_builtin(const vector<string> &argv){
+    static const char *names[AP_N] = { "other", "tokenize", "parse", "argv", "jobs" };
+    uint64_t lines = alloc_ctr->lines.load();
+    char line[128];
+    snprintf(line, sizeof(line), "%-10s %10s %12s %10s %12s\n", "phase", "allocs", "bytes", "frees", "allocs/line");
+    cout<<line;
+    for (int p=0;p<AP_N;++p){
+        uint64_t a = alloc_ctr->allocs[p].load();
+        snprintf(line, sizeof(line), "%-10s %10llu %12llu %10llu %12.2f\n", names[p], (unsigned long long)a,
+            (unsigned long long)alloc_ctr->bytes[p].load(), (unsigned long long)alloc_ctr->frees[p].load(), lines? (double)a/lines : 0.0);
+        cout<<line;
+    }
+    cout<<lines<<" lines\n";
+    if (argv.size()>1 && argv[1]=="-r"){
+        for (int p=0;p<AP_N;++p){ alloc_ctr->allocs[p] = 0; alloc_ctr->bytes[p] = 0; alloc_ctr->frees[p] = 0; }
+        alloc_ctr->lines = 0;
+    }
+    return 0;
+}
+#else
+#define ALLOC_PHASE(p) do {} while (0)
+#define ALLOC_LINE() do {} while (0)
+void allocstat_init(){}
+int allocstat_builtin(const vector<string> &){
+    cerr<<"allocstat: rebuild with -DSIMPLESHELL_ALLOCSTAT\n";
+    return 1;
+}
+#endif
 
 // ---- Utility functions ----
 string trim(const string &s) {
@@ -52,8 +259,46 @@ string trim(const string &s) {
     return s.substr(a, b-a+1);
 }
 
+bool write_all(int fd, const char *p, size_t n){
+    while (n>0){
+        ssize_t w = write(fd, p, n);
+        if (w<0){ if (errno==EINTR) continue; return false; }
+        p += w; n -= (size_t)w;
+    }
+    return true;
+}
+
+// A MAP_SHARED region backed by a memfd (its fd in fd; -1 and an anonymous
+// mapping if memfd_create fails), so exec-upgrade can hand it on.
+static void* shared_region(size_t size, const char *name, int &fd){
+    fd = memfd_create(name, MFD_CLOEXEC);
+    if (fd>=0 && ftruncate(fd, (off_t)size)<0){ close(fd); fd = -1; }
+    void *m = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | (fd<0? MAP_ANONYMOUS : 0), fd, 0);
+    if (m==MAP_FAILED && fd>=0){ close(fd); fd = -1; }
+    return m;
+}
+
+// Per-user directory for sockets and state: $XDG_RUNTIME_DIR/simpleshell or /tmp/simpleshell-UID.
+// "" if it exists but is not a private directory of ours (someone else could
+// have created it under /tmp to read session keystrokes or plant journals).
+string runtime_dir(){
+    const char *rt = getenv("XDG_RUNTIME_DIR");
+    string dir = rt? string(rt)+"/simpleshell" : "/tmp/simpleshell-"+to_string(getuid());
+    if (mkdir(dir.c_str(), 0700)<0 && errno!=EEXIST){ perror(dir.c_str()); return ""; }
+    struct stat st;
+    if (lstat(dir.c_str(), &st)<0 || !S_ISDIR(st.st_mode) || st.st_uid!=getuid() || (st.st_mode & 0777)!=0700){
+        static bool warned = false;
+        if (!warned) cerr<<"simple-shell: "<<dir<<" is not a directory owned by us with mode 0700; not using it\n";
+        warned = true;
+        return "";
+    }
+    return dir;
+}
+
 vector<string> split_tokens(const string &line) {
     // Very simple tokenizer that keeps special tokens: |, <, >, >>, &
+    ALLOC_PHASE(AP_TOKENIZE);
+    SHELL_PROBE2(tokenize__start, line.c_str(), line.size());
     vector<string> toks;
     string cur;
     for (size_t i=0;i<line.size();){
@@ -77,6 +322,7 @@ vector<string> split_tokens(const string &line) {
             if (!cur.empty()) { toks.push_back(cur); cur.clear(); }
         }
     }
+    SHELL_PROBE1(tokenize__done, toks.size());
     return toks;
 }
 
@@ -90,6 +336,8 @@ struct Command {
 
 // Parse tokens into pipeline of Commands. Last token may be & for background.
 pair<vector<Command>, bool> parse_pipeline(const vector<string> &toks){
+    SHELL_PROBE1(parse__start, toks.size());
+    ALLOC_PHASE(AP_PARSE);
     vector<Command> pipeline;
     Command cur;
     bool background = false;
@@ -111,33 +359,344 @@ pair<vector<Command>, bool> parse_pipeline(const vector<string> &toks){
         }
     }
     if (!cur.argv.empty() || !cur.infile.empty() || !cur.outfile.empty()) pipeline.push_back(cur);
+    SHELL_PROBE2(parse__done, pipeline.size(), (int)background);
     return {pipeline, background};
 }
 
 // Convert vector<string> to char* argv[] for exec
 vector<char*> make_argv(const vector<string> &v){
+    ALLOC_PHASE(AP_ARGV);
     vector<char*> argv;
     for (auto &s: v) argv.push_back(const_cast<char*>(s.c_str()));
     argv.push_back(nullptr);
     return argv;
 }
 
+// ---- Flight recorder ----
+// A fixed ring of the last FR_CAP shell events (line read, parse, spawn,
+// exec failure, reap, job state change, terminal handoff) with monotonic
+// nanosecond timestamps. Recording is a relaxed fetch_add plus a vDSO clock
+// read, so it is always on. The ring is a shared mapping, letting forked
+// children log exec failures into it. `flightrec` prints it; SIGQUIT and
+// fatal signals dump it to runtime_dir()/flightrec-<pid> with
+// async-signal-safe writes only.
+
+enum { FR_LINE = 1, FR_PARSE, FR_SPAWN, FR_EXEC_FAIL, FR_REAP, FR_STATE, FR_TTY };
+static const char *fr_names[] = { "?", "line", "parse", "spawn", "exec-fail", "reap", "state", "tty" };
+static const uint64_t FR_CAP = 4096;   // power of two
+
+struct FrEvent {
+    atomic<uint64_t> seq;   // index+1 once complete, 0 while being written
+    uint64_t ns;
+    int64_t b;
+    int32_t a;
+    uint32_t type;
+};
+
+struct FlightRing {
+    uint64_t ns0;
+    atomic<uint64_t> head;
+    FrEvent ev[FR_CAP];
+};
+
+static FlightRing *fr = nullptr;
+static int fr_fd = -1;
+static char fr_path[PATH_MAX];
+
+static inline uint64_t mono_ns(){
+    struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// Async-signal-safe.
+static inline void fr_record(uint32_t type, int32_t a, int64_t b){
+    if (!fr) return;
+    uint64_t i = fr->head.fetch_add(1, memory_order_relaxed);
+    FrEvent &e = fr->ev[i & (FR_CAP-1)];
+    e.seq.store(0, memory_order_relaxed);
+    e.ns = mono_ns(); e.a = a; e.b = b; e.type = type;
+    e.seq.store(i+1, memory_order_release);
+}
+
+// Decimal formatting without stdio, for use in signal handlers.
+static char* fr_fmt(char *p, int64_t v){
+    char t[24]; int n = 0;
+    uint64_t u = v<0? -(uint64_t)v : (uint64_t)v;
+    do { t[n++] = (char)('0'+u%10); u /= 10; } while (u);
+    if (v<0) *p++ = '-';
+    while (n) *p++ = t[--n];
+    return p;
+}
+
+// Write the ring oldest-first to fd. Async-signal-safe.
+static void fr_dump(int fd){
+    if (!fr) return;
+    uint64_t head = fr->head.load(memory_order_acquire);
+    for (uint64_t i = head>FR_CAP? head-FR_CAP : 0; i<head; ++i){
+        FrEvent &e = fr->ev[i & (FR_CAP-1)];
+        if (e.seq.load(memory_order_acquire)!=i+1) continue;   // overwritten or mid-write
+        char line[128], *p = line;
+        uint64_t us = (e.ns-fr->ns0)/1000;
+        p = fr_fmt(p, (int64_t)(us/1000000)); *p++ = '.';
+        char frac[8]; char *q = fr_fmt(frac, (int64_t)(us%1000000 + 1000000));
+        memcpy(p, frac+1, q-frac-1); p += q-frac-1;   // six digits, zero padded
+        *p++ = ' ';
+        const char *name = e.type<sizeof(fr_names)/sizeof(*fr_names)? fr_names[e.type] : "?";
+        size_t nl = strlen(name); memcpy(p, name, nl); p += nl;
+        memcpy(p, " a=", 3); p = fr_fmt(p+3, e.a);
+        memcpy(p, " b=", 3); p = fr_fmt(p+3, e.b);
+        *p++ = '\n';
+        if (!write_all(fd, line, p-line)) return;
+    }
+}
+
+static void fr_signal_handler(int sig){
+    int saved_errno = errno;
+    int fd = fr_path[0]? open(fr_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW, 0600) : -1;
+    if (fd>=0){
+        fr_dump(fd); close(fd);
+        const char msg[] = "simple-shell: flight recorder written to ";
+        write_all(STDERR_FILENO, msg, sizeof(msg)-1);
+        write_all(STDERR_FILENO, fr_path, strlen(fr_path));
+        write_all(STDERR_FILENO, "\n", 1);
+    }
+    errno = saved_errno;
+    if (sig!=SIGQUIT){ signal(sig, SIG_DFL); raise(sig); }   // let the crash proceed
+}
+
+void fr_init(){
+    void *m = shared_region(sizeof(FlightRing), "simpleshell-flightrec", fr_fd);
+    if (m==MAP_FAILED) return;
+    fr = (FlightRing*)m;
+    fr->ns0 = mono_ns();
+    string dir = runtime_dir();
+    if (!dir.empty()) snprintf(fr_path, sizeof(fr_path), "%s/flightrec-%d", dir.c_str(), (int)getpid());
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = fr_signal_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGQUIT, &sa, nullptr);
+    sa.sa_flags = SA_RESETHAND;
+    for (int s: { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT }) sigaction(s, &sa, nullptr);
+}
+
+// flightrec [-c]: print the recorder, oldest event first; -c clears it.
+int flightrec_builtin(const vector<string> &argv){
+    if (!fr){ cerr<<"flightrec: not available\n"; return 1; }
+    if (argv.size()>1 && argv[1]=="-c"){
+        for (auto &e: fr->ev) e.seq.store(0, memory_order_relaxed);
+        return 0;
+    }
+    cout<<flush;
+    fr_dump(STDOUT_FILENO);
+    return 0;
+}
+
+// ---- Latency stats ----
+// Always-on histograms of the shell's own phases. Samples are raw ticks
+// (rdtsc where available) added with relaxed atomics; the histograms live in
+// a shared anonymous mapping so forked children can record the phases that
+// happen after fork (argv build, fork-to-exec) and the exec time that the
+// parent needs for exec-to-exit when it reaps them. Buckets are log-linear:
+// 16 sub-buckets per power of two, so percentiles are within ~6%.
+
+enum { LAT_PARSE, LAT_EXPAND, LAT_FORK_EXEC, LAT_EXEC_EXIT, LAT_TTY, LAT_N };
+static const char *lat_names[LAT_N] = { "parse", "expand", "fork-exec", "exec-exit", "tty-handoff" };
+static const int LAT_BUCKETS = 976;   // covers the full 64-bit range
+static const int LAT_EXEC_SLOTS = 256;
+
+struct LatHist {
+    atomic<uint64_t> count, sum, max;
+    atomic<uint64_t> b[LAT_BUCKETS];
+};
+
+struct StatsPage {
+    uint64_t tick0;                      // tick and wall clock at startup, to
+    struct timespec mono0;               // convert ticks to time when printing
+    LatHist h[LAT_N];
+    struct { atomic<pid_t> pid; atomic<uint64_t> t; } exec[LAT_EXEC_SLOTS];   // exec time per child
+    atomic<uint32_t> exec_next;
+};
+
+static StatsPage *stats_page = nullptr;
+static int stats_fd = -1;
+
+static inline uint64_t stat_ticks(){
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ull + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+static inline int lat_bucket(uint64_t v){
+    if (v<16) return (int)v;
+    int e = 63-__builtin_clzll(v);
+    return (e-3)*16 + (int)((v>>(e-4)) & 15);
+}
+
+static uint64_t lat_bucket_low(int idx){
+    if (idx<16) return (uint64_t)idx;
+    int e = idx/16+3;
+    return (uint64_t)(16+idx%16) << (e-4);
+}
+
+// Async-signal-safe.
+static inline void lat_record(int phase, uint64_t ticks){
+    if (!stats_page) return;
+    LatHist &h = stats_page->h[phase];
+    h.count.fetch_add(1, memory_order_relaxed);
+    h.sum.fetch_add(ticks, memory_order_relaxed);
+    h.b[lat_bucket(ticks)].fetch_add(1, memory_order_relaxed);
+    uint64_t m = h.max.load(memory_order_relaxed);
+    while (ticks>m && !h.max.compare_exchange_weak(m, ticks, memory_order_relaxed)) {}
+}
+
+// In a child just before execvp.
+static void lat_mark_exec(uint64_t fork_tick){
+    if (!stats_page) return;
+    uint64_t now = stat_ticks();
+    lat_record(LAT_FORK_EXEC, now-fork_tick);
+    auto &s = stats_page->exec[stats_page->exec_next.fetch_add(1, memory_order_relaxed) % LAT_EXEC_SLOTS];
+    s.t.store(now, memory_order_relaxed);
+    s.pid.store(getpid(), memory_order_release);
+}
+
+// When pid has been reaped. Async-signal-safe.
+static void lat_mark_exit(pid_t pid){
+    if (!stats_page) return;
+    for (auto &s: stats_page->exec){
+        if (s.pid.load(memory_order_acquire)!=pid) continue;
+        lat_record(LAT_EXEC_EXIT, stat_ticks()-s.t.load(memory_order_relaxed));
+        s.pid.store(0, memory_order_relaxed);
+        return;
+    }
+}
+
+void stats_init(){
+    void *m = shared_region(sizeof(StatsPage), "simpleshell-stats", stats_fd);
+    if (m==MAP_FAILED) return;   // zero-filled, which is a valid empty state
+    stats_page = (StatsPage*)m;
+    stats_page->tick0 = stat_ticks();
+    clock_gettime(CLOCK_MONOTONIC, &stats_page->mono0);
+}
+
+// Nanoseconds per tick, measured over the shell's lifetime so far.
+static double stat_ns_per_tick(){
+#if defined(__x86_64__) || defined(__i386__)
+    struct timespec now; clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t dt = stat_ticks()-stats_page->tick0;
+    double ns = (now.tv_sec-stats_page->mono0.tv_sec)*1e9 + (now.tv_nsec-stats_page->mono0.tv_nsec);
+    return dt? ns/dt : 1.0;
+#else
+    return 1.0;
+#endif
+}
+
+static string fmt_ns(double ns){
+    char b[32];
+    if (ns<1e3) snprintf(b, sizeof(b), "%.0fns", ns);
+    else if (ns<1e6) snprintf(b, sizeof(b), "%.1fus", ns/1e3);
+    else if (ns<1e9) snprintf(b, sizeof(b), "%.1fms", ns/1e6);
+    else snprintf(b, sizeof(b), "%.2fs", ns/1e9);
+    return b;
+}
+
+// stats [-r]: print per-phase percentiles; -r resets afterwards.
+int stats_builtin(const vector<string> &argv){
+    if (!stats_page){ cerr<<"stats: not available\n"; return 1; }
+    bool reset = argv.size()>1 && argv[1]=="-r";
+    double k = stat_ns_per_tick();
+    char line[160];
+    snprintf(line, sizeof(line), "%-12s %8s %9s %9s %9s %9s %9s\n", "phase", "count", "mean", "p50", "p90", "p99", "max");
+    cout<<line;
+    for (int p=0;p<LAT_N;++p){
+        LatHist &h = stats_page->h[p];
+        uint64_t n = h.count.load(memory_order_relaxed);
+        if (!n){ snprintf(line, sizeof(line), "%-12s %8d\n", lat_names[p], 0); cout<<line; continue; }
+        const double qs[3] = { 0.50, 0.90, 0.99 };
+        string qv[3];
+        uint64_t seen = 0; int qi = 0;
+        for (int i=0;i<LAT_BUCKETS && qi<3;++i){
+            seen += h.b[i].load(memory_order_relaxed);
+            while (qi<3 && seen>=(uint64_t)ceil(qs[qi]*n)) qv[qi++] = fmt_ns(lat_bucket_low(i)*k);
+        }
+        snprintf(line, sizeof(line), "%-12s %8llu %9s %9s %9s %9s %9s\n", lat_names[p], (unsigned long long)n,
+            fmt_ns((double)h.sum.load(memory_order_relaxed)/n*k).c_str(),
+            qv[0].c_str(), qv[1].c_str(), qv[2].c_str(), fmt_ns(h.max.load(memory_order_relaxed)*k).c_str());
+        cout<<line;
+    }
+    if (reset)
+        for (auto &h: stats_page->h){
+            h.count.store(0, memory_order_relaxed); h.sum.store(0, memory_order_relaxed); h.max.store(0, memory_order_relaxed);
+            for (auto &c: h.b) c.store(0, memory_order_relaxed);
+        }
+    return 0;
+}
+
+// Hand the terminal to pgrp, timing the switch.
+static void tty_handoff(pid_t pgrp){
+    uint64_t t = stat_ticks();
+    tcsetpgrp(STDIN_FILENO, pgrp);
+    lat_record(LAT_TTY, stat_ticks()-t);
+    fr_record(FR_TTY, pgrp, 0);
+}
+
 // Job management
-int add_job(pid_t pgid, const string &cmdline, bool bg){
+int add_job(pid_t pgid, const string &cmdline, bool bg, const vector<pid_t> &pids){
+    ALLOC_PHASE(AP_JOBS);
     Job j; j.id = next_job_id++; j.pgid = pgid; j.cmdline = cmdline; j.is_background = bg; j.status = 0;
+    j.pids = pids; j.live = (int)pids.size();
+    j.starts.assign(pids.size(), boot_ticks());   // after every fork: >= each stage's start time
     jobs.push_back(j);
+    jobs_launched_total.fetch_add(1, memory_order_relaxed);
+    // long runs of launches between prompts (tasks) would fill the region
+    if (journal_nearly_full()) journal_checkpoint();
+    else journal_job(j, 1 /* JREC_ADD */);
     return j.id;
 }
 
+void set_job_status(Job &j, int status){
+    if (j.status==status) return;
+    j.status = status;
+    fr_record(FR_STATE, j.id, status);
+    SHELL_PROBE3(job__state, j.id, j.pgid, status);
+    if (status==2) jobs_done_total.fetch_add(1, memory_order_relaxed);
+    journal_job(j, 2 /* JREC_STATE */);
+}
+
+// Apply a waitpid() status for pid to its job. Async-signal-safe (no allocation).
+void job_update(pid_t pid, int status){
+    for (auto &j: jobs){
+        if (find(j.pids.begin(), j.pids.end(), pid)==j.pids.end()) continue;
+        fr_record(FR_REAP, pid, status);
+        SHELL_PROBE3(reap, pid, status, j.id);
+        if (WIFEXITED(status) || WIFSIGNALED(status)){
+            lat_mark_exit(pid);
+            if (pid==j.pids.back()) j.exit_status = status;
+            if (--j.live<=0) set_job_status(j, 2);
+        } else if (WIFSTOPPED(status)){
+            set_job_status(j, 1);
+        } else if (WIFCONTINUED(status)){
+            set_job_status(j, 0);
+        }
+        return;
+    }
+}
+
 void mark_job_as_done(pid_t pgid){
-    for (auto &j: jobs) if (j.pgid==pgid) j.status = 2;
+    for (auto &j: jobs) if (j.pgid==pgid) set_job_status(j, 2);
 }
 
 void mark_job_as_stopped(pid_t pgid){
-    for (auto &j: jobs) if (j.pgid==pgid) j.status = 1;
+    for (auto &j: jobs) if (j.pgid==pgid) set_job_status(j, 1);
 }
 
 void remove_completed_jobs(){
+    ALLOC_PHASE(AP_JOBS);
+    for (auto &j: jobs) if (j.status==2){ journal_job(j, 3 /* JREC_REMOVE */); for (int fd: j.pidfds) if (fd>=0) close(fd); }
     jobs.erase(remove_if(jobs.begin(), jobs.end(), [](const Job &j){ return j.status==2; }), jobs.end());
 }
 
@@ -153,200 +712,4379 @@ Job* find_last_job(){
     if (jobs.empty()) return nullptr; return &jobs.back();
 }
 
-// ---- Built-in commands ----
-bool is_builtin(const vector<string> &argv){
-    if (argv.empty()) return false;
-    string cmd = argv[0];
-    return (cmd=="cd" || cmd=="exit" || cmd=="jobs" || cmd=="fg" || cmd=="bg" );
-}
+// ---- Job journal ----
+// Job state changes are appended to a memory-mapped file of fixed-size
+// records so a restarted shell can rebuild its job table after a crash.
+// The file is $SIMPLESHELL_JOURNAL ("off" disables it), else
+// runtime_dir()/journal-<tty>. It holds a header and two record regions;
+// appends go to the active region and a checkpoint writes a snapshot of
+// the live jobs into the other one before flipping `active`, so a crash at
+// any point leaves one consistent region. Appending only stores into the
+// mapping, so it is safe from the SIGCHLD handler. Children that run shell
+// code (builtins in pipelines, workers, cache) drop the mapping first so
+// they cannot append records under their own job ids.
+//
+// Stage start times are taken from CLOCK_BOOTTIME once per job after the
+// forks rather than read from /proc per stage; recovery accepts a process
+// whose /proc start time is at most JOURNAL_START_SLACK ticks earlier.
 
-int run_builtin(const vector<string> &argv){
-    if (argv.empty()) return 0;
-    string cmd = argv[0];
-    if (cmd=="cd"){
-        const char *path = argv.size()>1 ? argv[1].c_str() : getenv("HOME");
-        if (chdir(path)!=0) perror("cd");
-        return 0;
-    } else if (cmd=="exit"){
-        exit(0);
-    } else if (cmd=="jobs"){
-        for (auto &j: jobs){
-            string st = (j.status==0?"Running": (j.status==1?"Stopped":"Done"));
-            cout << "["<<j.id<<"] "<< st << "\t"<< j.cmdline << " (pgid="<< j.pgid<<")"<<"\n";
-        }
-        remove_completed_jobs();
-        return 0;
-    } else if (cmd=="fg"){
-        // fg %jobid or fg jobid or fg default last
-        int id = -1;
-        if (argv.size()>1){ string s = argv[1]; if (s.size()>0 && s[0]=='%') s = s.substr(1); id = stoi(s); }
-        Job *j = (id==-1? find_last_job() : find_job_by_id(id));
-        if (!j){ cerr<<"fg: no such job\n"; return -1; }
-        // bring to foreground
-        j->is_background = false;
-        // send SIGCONT
-        if (kill(-j->pgid, SIGCONT) < 0) perror("kill(SIGCONT)");
-        // give terminal to job
-        tcsetpgrp(STDIN_FILENO, j->pgid);
-        // wait for it
-        int status;
-        waitpid(-j->pgid, &status, WUNTRACED);
-        // restore terminal control to shell
-        tcsetpgrp(STDIN_FILENO, shell_pgid);
-        if (WIFSTOPPED(status)) { j->status = 1; }
-        else { j->status = 2; }
-        remove_completed_jobs();
-        return 0;
-    } else if (cmd=="bg"){
-        int id = -1;
-        if (argv.size()>1){ string s = argv[1]; if (s.size()>0 && s[0]=='%') s = s.substr(1); id = stoi(s); }
-        Job *j = (id==-1? find_last_job() : find_job_by_id(id));
-        if (!j){ cerr<<"bg: no such job\n"; return -1; }
-        j->is_background = true;
-        if (kill(-j->pgid, SIGCONT) < 0) perror("kill(SIGCONT)");
-        j->status = 0;
-        cout<<"["<<j->id<<"] "<< j->cmdline <<" &\n";
-        return 0;
-    }
-    return 0;
-}
+enum { JREC_ADD = 1, JREC_STATE = 2, JREC_REMOVE = 3 };
+static const uint32_t JOURNAL_MAGIC = 0x534a524e;  // "SJRN"
+static const uint32_t JOURNAL_CAP = 4096;           // records per region
+static const int JOURNAL_PIDS = 8;                  // stages recorded per job
+static const uint64_t JOURNAL_START_SLACK = 100;    // clock ticks (1 s at USER_HZ=100)
 
-// ---- Execution ----
+struct JournalRec {
+    atomic<uint64_t> seq;     // 0 = empty slot; written last
+    uint8_t type, status, npids, pad;
+    int32_t id, pgid, exit_status;
+    int32_t pids[JOURNAL_PIDS];
+    uint64_t starts[JOURNAL_PIDS];  // /proc starttime, guards against pid reuse
+    char cmd[132];
+};
+static_assert(sizeof(JournalRec)==256, "journal records are 256 bytes");
 
-void launch_pipeline(vector<Command> &pipeline, bool background, const string &cmdline){
-    size_t n = pipeline.size();
-    vector<int> pipefds;
-    pipefds.resize((n>1? (n-1)*2:0));
-    for (size_t i=0;i+1<n;++i){ if (pipe(pipefds.data()+2*i) < 0) { perror("pipe"); return; } }
+struct JournalHeader {
+    uint32_t magic, version;
+    atomic<uint32_t> active;     // region being appended to
+    atomic<uint32_t> count;      // slots reserved in the active region
+    atomic<uint64_t> seq;
+    char pad[4096-24];
+};
 
-    pid_t pgid = 0;
-    vector<pid_t> pids;
+static JournalHeader *journal = nullptr;
+static int journal_fd = -1;
+static volatile sig_atomic_t journal_dropped = 0;   // appends lost to a full region
+static const size_t JOURNAL_SIZE = sizeof(JournalHeader) + 2*(size_t)JOURNAL_CAP*sizeof(JournalRec);
 
-    for (size_t i=0;i<n;++i){
-        // set up fds
-        int in_fd = -1, out_fd = -1;
-        if (i>0) in_fd = pipefds[(i-1)*2];
-        if (i+1<n) out_fd = pipefds[i*2+1];
+static JournalRec* journal_region(uint32_t r){ return (JournalRec*)(journal+1) + (size_t)r*JOURNAL_CAP; }
 
-        pid_t pid = fork();
-        if (pid < 0){ perror("fork"); return; }
-        if (pid==0){
-            // child
-            // set pgid
-            if (pgid==0) pgid = getpid();
-            setpgid(0, pgid);
-            if (!background) tcsetpgrp(STDIN_FILENO, pgid);
-            // restore default signals
-            signal(SIGINT, SIG_DFL);
-            signal(SIGTSTP, SIG_DFL);
-            signal(SIGCHLD, SIG_DFL);
+// Now, in the units of /proc/pid/stat's starttime.
+uint64_t boot_ticks(){
+    static long hz = sysconf(_SC_CLK_TCK);
+    struct timespec ts;
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    return (uint64_t)ts.tv_sec*hz + (uint64_t)ts.tv_nsec/(1000000000/hz);
+}
 
-            // input from previous pipe
-            if (in_fd!=-1){ dup2(in_fd, STDIN_FILENO); }
-            // output to next pipe
-            if (out_fd!=-1){ dup2(out_fd, STDOUT_FILENO); }
-            // handle redirection if present (only for endpoints)
-            if (i==0 && !pipeline[i].infile.empty()){
-                int fd = open(pipeline[i].infile.c_str(), O_RDONLY);
-                if (fd<0){ perror("open infile"); exit(1); }
-                dup2(fd, STDIN_FILENO);
-            }
-            if (i==n-1 && !pipeline[i].outfile.empty()){
-                int flags = O_WRONLY | O_CREAT | (pipeline[i].append? O_APPEND: O_TRUNC);
-                int fd = open(pipeline[i].outfile.c_str(), flags, 0644);
-                if (fd<0){ perror("open outfile"); exit(1); }
-                dup2(fd, STDOUT_FILENO);
-            }
-            // close all pipe fds
-            for (int fd: pipefds) if (fd!=-1) close(fd);
+// Process start time in clock ticks since boot (field 22 of /proc/pid/stat), 0 if gone.
+uint64_t proc_start_time(pid_t pid){
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd<0) return 0;
+    ssize_t n = read(fd, buf, sizeof(buf)-1);
+    close(fd);
+    if (n<=0) return 0;
+    buf[n] = 0;
+    char *p = strrchr(buf, ')');   // comm may contain spaces
+    for (int field = 2; p && field<22; ++field) p = strchr(p+1, ' ');
+    return p? strtoull(p+1, nullptr, 10) : 0;
+}
 
-            // exec
-            if (pipeline[i].argv.empty()) exit(0);
-            if (is_builtin(pipeline[i].argv)){
-                // execute builtin in child (rare) then exit
-                run_builtin(pipeline[i].argv);
-                exit(0);
-            }
-            auto argv = make_argv(pipeline[i].argv);
-            execvp(argv[0], argv.data());
-            perror("execvp");
-            exit(1);
-        } else {
-            // parent
-            if (pgid==0) pgid = pid;
-            setpgid(pid, pgid);
-            pids.push_back(pid);
-        }
+static void journal_fill(JournalRec &r, const Job &j, int type){
+    r.type = (uint8_t)type; r.status = (uint8_t)j.status;
+    r.id = j.id; r.pgid = j.pgid; r.exit_status = j.exit_status;
+    r.npids = (uint8_t)min<size_t>(j.pids.size(), JOURNAL_PIDS);
+    for (int k=0;k<r.npids;++k){ r.pids[k] = j.pids[k]; r.starts[k] = k<(int)j.starts.size()? j.starts[k] : 0; }
+    if (type==JREC_ADD){
+        size_t n = min(j.cmdline.size(), sizeof(r.cmd)-1);
+        memcpy(r.cmd, j.cmdline.data(), n); r.cmd[n] = 0;
     }
+}
 
-    // parent: close pipes
-    for (int fd: pipefds) if (fd!=-1) close(fd);
-
-    // record job
-    int jid = add_job(pgid, cmdline, background);
+void journal_job(const Job &j, int type){
+    if (!journal || j.worker!=-1) return;
+    uint32_t slot = journal->count.fetch_add(1);
+    if (slot>=JOURNAL_CAP){ journal_dropped++; return; }   // reported and repaired by journal_tick
+    JournalRec &r = journal_region(journal->active.load())[slot];
+    journal_fill(r, j, type);
+    r.seq.store(journal->seq.fetch_add(1)+1, memory_order_release);
+}
 
-    if (!background){
-        // give terminal to child
-        tcsetpgrp(STDIN_FILENO, pgid);
-        // wait for job to finish or stop
-        int status;
-        pid_t w;
-        do {
-            w = waitpid(-pgid, &status, WUNTRACED);
-        } while (w>0 && !WIFSTOPPED(status) && !WIFEXITED(status) && !WIFSIGNALED(status));
+// Rewrite the live jobs into the inactive region and make it active.
+void journal_checkpoint(){
+    if (!journal) return;
+    sigset_t old;
+    block_sigchld(&old);
+    uint32_t next = 1 - journal->active.load();
+    JournalRec *reg = journal_region(next);
+    for (uint32_t k=0;k<JOURNAL_CAP;++k) reg[k].seq.store(0, memory_order_relaxed);
+    uint32_t n = 0;
+    for (auto &j: jobs){
+        if (j.worker!=-1 || j.status==2 || n>=JOURNAL_CAP) continue;
+        journal_fill(reg[n], j, JREC_ADD);
+        reg[n++].seq.store(journal->seq.fetch_add(1)+1, memory_order_release);
+    }
+    msync(journal, sizeof(JournalHeader), MS_ASYNC);
+    journal->count.store(n);
+    journal->active.store(next);
+    sigprocmask(SIG_SETMASK, &old, nullptr);
+}
 
-        // restore terminal to shell
-        tcsetpgrp(STDIN_FILENO, shell_pgid);
-        if (WIFSTOPPED(status)){
-            mark_job_as_stopped(pgid);
-            cerr<<"\n["<<jid<<"] Stopped\t"<< cmdline <<"\n";
-        } else {
-            mark_job_as_done(pgid);
-            remove_completed_jobs();
+// Called before each prompt: compact when the active region fills up and
+// notice exits of jobs adopted from a previous shell (not our children).
+void journal_tick(){
+    for (auto &j: jobs){
+        if (j.pidfds.empty() || j.status==2) continue;
+        for (auto &fd: j.pidfds){
+            if (fd<0) continue;
+            struct pollfd p = {fd, POLLIN, 0};
+            if (poll(&p, 1, 0)==1){ close(fd); fd = -1; j.live--; }
         }
-    } else {
-        cout<<"["<<jid<<"] "<<pgid<<"\n"; // print job id and pgid
+        if (j.live<=0) set_job_status(j, 2);
     }
+    if (journal && journal_dropped){
+        cerr<<"simple-shell: job journal was full, "<<journal_dropped<<" record(s) dropped; checkpointing\n";
+        journal_dropped = 0;
+        journal_checkpoint();
+    }
+    if (journal_nearly_full()) journal_checkpoint();
 }
 
-// ---- Signal handlers ----
-void sigchld_handler(int sig){
-    // Reap children; update job statuses
-    int saved_errno = errno;
-    while (true){
-        int status;
-        pid_t pid = waitpid(-1, &status, WNOHANG | WUNTRACED | WCONTINUED);
-        if (pid<=0) break;
-        // find job by pgid
-        pid_t pgid = getpgid(pid);
-        if (pgid>0){
-            if (WIFEXITED(status) || WIFSIGNALED(status)){
-                mark_job_as_done(pgid);
-            } else if (WIFSTOPPED(status)){
-                mark_job_as_stopped(pgid);
-            } else if (WIFCONTINUED(status)){
-                Job *j = find_job_by_pgid(pgid); if (j) j->status = 0;
-            }
+bool journal_nearly_full(){ return journal && journal->count.load()>JOURNAL_CAP*3/4; }
+
+// In a forked child that keeps running shell code: forget the parent's
+// journal (the flock belongs to the parent's open file and survives).
+void journal_detach(){
+    if (!journal) return;
+    munmap(journal, JOURNAL_SIZE);
+    close(journal_fd);
+    journal = nullptr; journal_fd = -1;
+}
+
+// Open (or create) the journal and adopt still-running jobs recorded in it.
+void journal_open(){
+    if (journal) return;   // carried over by exec-upgrade
+    const char *env = getenv("SIMPLESHELL_JOURNAL");
+    if (env && string(env)=="off") return;
+    string path;
+    if (env) path = env;
+    else {
+        const char *tty = ttyname(STDIN_FILENO);
+        string t = tty? tty+5 : "notty";   // strip "/dev/"
+        replace(t.begin(), t.end(), '/', '-');
+        string dir = runtime_dir();
+        if (dir.empty()) return;
+        path = dir+"/journal-"+t;
+    }
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd<0) return;
+    if (flock(fd, LOCK_EX | LOCK_NB)<0){ close(fd); return; }   // another live shell owns it
+    size_t size = JOURNAL_SIZE;
+    struct stat st;
+    bool fresh = fstat(fd, &st)<0 || (size_t)st.st_size!=size;
+    if (fresh && ftruncate(fd, (off_t)size)<0){ close(fd); return; }
+    void *m = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (m==MAP_FAILED){ close(fd); return; }
+    journal = (JournalHeader*)m; journal_fd = fd;
+    if (fresh || journal->magic!=JOURNAL_MAGIC){
+        memset(m, 0, size);
+        journal->magic = JOURNAL_MAGIC; journal->version = 1;
+        return;
+    }
+
+    // replay the active region
+    map<int, JournalRec*> latest;   // job id -> add record
+    map<int, pair<int,int>> state;  // job id -> (status, exit status)
+    JournalRec *reg = journal_region(journal->active.load());
+    uint32_t n = min(journal->count.load(), JOURNAL_CAP);
+    for (uint32_t k=0;k<n && reg[k].seq.load(memory_order_acquire);++k){
+        JournalRec &r = reg[k];
+        if (r.type==JREC_ADD) latest[r.id] = &r;
+        if (r.type==JREC_REMOVE){ latest.erase(r.id); state.erase(r.id); }
+        else state[r.id] = {r.status, r.exit_status};
+    }
+    int adopted = 0;
+    for (auto &e: latest){
+        JournalRec &r = *e.second;
+        if (state[r.id].first==2) continue;
+        Job j; j.id = r.id; j.pgid = r.pgid; j.cmdline = r.cmd; j.is_background = true; j.status = state[r.id].first;
+        for (int k=0;k<r.npids;++k){
+            uint64_t st = proc_start_time(r.pids[k]);
+            if (!st || st>r.starts[k] || r.starts[k]-st>JOURNAL_START_SLACK) continue;   // gone or pid reused
+            int pfd = (int)syscall(SYS_pidfd_open, r.pids[k], 0);
+            if (pfd<0) continue;
+            fcntl(pfd, F_SETFD, FD_CLOEXEC);
+            j.pids.push_back(r.pids[k]); j.starts.push_back(r.starts[k]); j.pidfds.push_back(pfd);
         }
+        if (j.pids.empty()) continue;
+        j.live = (int)j.pids.size();
+        next_job_id = max(next_job_id, j.id+1);
+        jobs.push_back(j);
+        adopted++;
     }
-    errno = saved_errno;
+    journal_checkpoint();
+    if (adopted) cerr<<"simple-shell: recovered "<<adopted<<" job(s) from "<<path<<"\n";
 }
 
-void sigint_handler(int sig){
-    // forward SIGINT to foreground process group
-    pid_t fg = tcgetpgrp(STDIN_FILENO);
-    if (fg!=shell_pgid){ kill(-fg, SIGINT); }
+// ---- Shared-memory stage transport ----
+// Opt-in replacement for a kernel pipe between two cooperating stages.
+// Commands listed in SIMPLESHELL_RING_CMDS (colon separated, e.g.
+// "producer:consumer:jsonl") advertise support; when both ends of a pipe are
+// listed, launch_pipeline also creates a memfd ring and exports its fd as
+// SIMPLESHELL_RING_OUT_FD to the producer and SIMPLESHELL_RING_IN_FD to the
+// consumer. The normal pipe stays connected as the fallback and for EOF.
+//
+// Layout: a RingHeader page followed by `capacity` data bytes. head/tail are
+// monotonically increasing byte counts; the *_seq words are futexes bumped
+// by the other side only when the matching *_waiting flag is set.
+// `reader` is the handshake: the consumer moves it from PENDING to ATTACHED
+// when it maps the ring and to CLOSED when it is done. A producer whose
+// reader has not attached within RING_ATTACH_MS claims it as UNUSED and
+// writes to the pipe instead; once the reader is closed (or its end of the
+// pipe is gone) writes fail with EPIPE rather than waiting for space.
+
+static const uint32_t RING_MAGIC = 0x53535247; // "SSRG"
+static const size_t RING_HDR = 4096;
+static const int RING_ATTACH_MS = 1000;
+enum : uint32_t { RING_PENDING = 0, RING_ATTACHED = 1, RING_CLOSED = 2, RING_UNUSED = 3 };
+
+struct RingHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t capacity;
+    alignas(64) atomic<uint64_t> head;
+    atomic<uint32_t> data_seq;
+    atomic<uint32_t> reader_waiting;
+    alignas(64) atomic<uint64_t> tail;
+    atomic<uint32_t> space_seq;
+    atomic<uint32_t> writer_waiting;
+    alignas(64) atomic<uint32_t> closed;
+    atomic<uint32_t> reader;
+};
+static_assert(sizeof(RingHeader)<=RING_HDR, "ring header must fit its page");
+
+static RingHeader *ring_in = nullptr, *ring_out = nullptr;
+
+static long futex_op(atomic<uint32_t> *w, int op, uint32_t val, const struct timespec *ts){
+    return syscall(SYS_futex, (uint32_t*)w, op, val, ts, nullptr, 0);
 }
 
-void sigtstp_handler(int sig){
-    pid_t fg = tcgetpgrp(STDIN_FILENO);
-    if (fg!=shell_pgid){ kill(-fg, SIGTSTP); }
+static void ring_wake(atomic<uint32_t> &seq){
+    seq.fetch_add(1);
+    futex_op(&seq, FUTEX_WAKE, INT_MAX, nullptr);
 }
 
-int main(){
-    // initialize shell process group and terminal
+bool ring_capable(const vector<string> &argv){
+    const char *list = getenv("SIMPLESHELL_RING_CMDS");
+    if (!list || argv.empty()) return false;
+    string name = argv[0].substr(argv[0].rfind('/')==string::npos? 0 : argv[0].rfind('/')+1);
+    string l = string(":")+list+":";
+    return l.find(":"+name+":")!=string::npos;
+}
+
+// Returns a memfd holding an initialised ring, or -1 (caller keeps the pipe).
+int ring_create(){
+    const char *sz = getenv("SIMPLESHELL_RING_SIZE");
+    uint64_t cap = sz? strtoull(sz, nullptr, 10) : (8u<<20);
+    if (cap<4096) cap = 4096;
+    int fd = memfd_create("simpleshell-ring", 0);
+    if (fd<0) return -1;
+    if (ftruncate(fd, (off_t)(RING_HDR+cap))<0){ close(fd); return -1; }
+    void *m = mmap(nullptr, RING_HDR, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (m==MAP_FAILED){ close(fd); return -1; }
+    RingHeader *h = new (m) RingHeader();
+    h->magic = RING_MAGIC; h->version = 2; h->capacity = cap;
+    munmap(m, RING_HDR);
+    return fd;
+}
+
+static RingHeader* ring_attach(const char *var){
+    const char *s = getenv(var);
+    if (!s) return nullptr;
+    int fd = atoi(s);
+    struct stat st;
+    if (fstat(fd, &st)<0 || (size_t)st.st_size<=RING_HDR) return nullptr;
+    void *m = mmap(nullptr, (size_t)st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m==MAP_FAILED) return nullptr;
+    RingHeader *h = (RingHeader*)m;
+    if (h->magic!=RING_MAGIC || h->version!=2 || RING_HDR+h->capacity!=(size_t)st.st_size){ munmap(m, (size_t)st.st_size); return nullptr; }
+    return h;
+}
+
+void stage_close();
+
+// Called by builtins that speak the protocol when they start in a stage.
+void stage_attach(){
+    ring_in = ring_attach("SIMPLESHELL_RING_IN_FD");
+    uint32_t pending = RING_PENDING;
+    if (ring_in && !ring_in->reader.compare_exchange_strong(pending, RING_ATTACHED)){
+        // the producer gave up on us and uses the pipe
+        munmap(ring_in, RING_HDR+ring_in->capacity);
+        ring_in = nullptr;
+    }
+    ring_out = ring_attach("SIMPLESHELL_RING_OUT_FD");
+    static bool registered = false;
+    if ((ring_in || ring_out) && !registered){ atexit(stage_close); registered = true; }
+}
+
+// The consumer's end of our stdout pipe is gone (it exited or closed it).
+static bool stage_reader_gone(){
+    struct pollfd pfd = {STDOUT_FILENO, 0, 0};
+    return poll(&pfd, 1, 0)==1 && (pfd.revents & POLLERR);
+}
+
+// Wait for the reader to attach; false means use the pipe.
+static bool ring_handshake(RingHeader *h){
+    for (int waited=0; ; waited+=10){
+        uint32_t r = h->reader.load();
+        if (r!=RING_PENDING) return r!=RING_UNUSED;
+        if (waited>=RING_ATTACH_MS || stage_reader_gone()){
+            uint32_t pending = RING_PENDING;
+            if (h->reader.compare_exchange_strong(pending, RING_UNUSED)) return false;
+            continue;   // attached (or closed) just now
+        }
+        usleep(10*1000);
+    }
+}
+
+bool stage_write(const char *p, size_t n){
+    RingHeader *h = ring_out;
+    if (h && h->reader.load()!=RING_ATTACHED && h->reader.load()!=RING_CLOSED && !ring_handshake(h)){
+        stage_close();   // EOF for a reader that attaches late anyway
+        ring_out = h = nullptr;
+    }
+    if (!h) return write_all(STDOUT_FILENO, p, n);
+    char *data = (char*)h + RING_HDR;
+    uint64_t cap = h->capacity;
+    while (n>0){
+        if (h->reader.load()==RING_CLOSED){ errno = EPIPE; return false; }
+        uint64_t head = h->head.load(memory_order_relaxed);
+        uint64_t space = cap - (head - h->tail.load(memory_order_acquire));
+        if (space==0){
+            if (stage_reader_gone()){ errno = EPIPE; return false; }
+            uint32_t seq = h->space_seq.load();
+            h->writer_waiting.store(1);
+            if (cap - (head - h->tail.load())==0 && h->reader.load()!=RING_CLOSED){
+                struct timespec ts = {0, 50*1000*1000};
+                futex_op(&h->space_seq, FUTEX_WAIT, seq, &ts);
+            }
+            h->writer_waiting.store(0);
+            continue;
+        }
+        size_t off = head % cap;
+        size_t k = (size_t)min<uint64_t>({(uint64_t)n, space, cap-off});
+        memcpy(data+off, p, k);
+        h->head.store(head+k);
+        if (h->reader_waiting.load()) ring_wake(h->data_seq);
+        p += k; n -= k;
+    }
+    return true;
+}
+
+ssize_t stage_read(char *p, size_t n){
+    RingHeader *h = ring_in;
+    if (!h){
+        ssize_t r;
+        do r = read(STDIN_FILENO, p, n); while (r<0 && errno==EINTR);
+        return r;
+    }
+    char *data = (char*)h + RING_HDR;
+    uint64_t cap = h->capacity;
+    while (true){
+        uint64_t tail = h->tail.load(memory_order_relaxed);
+        uint64_t avail = h->head.load(memory_order_acquire) - tail;
+        if (avail>0){
+            size_t off = tail % cap;
+            size_t k = (size_t)min<uint64_t>({(uint64_t)n, avail, cap-off});
+            memcpy(p, data+off, k);
+            h->tail.store(tail+k);
+            if (h->writer_waiting.load()) ring_wake(h->space_seq);
+            return (ssize_t)k;
+        }
+        if (h->closed.load()) { if (h->head.load()==tail) return 0; continue; }
+        // Producer died without closing: its pipe end hangs up.
+        struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+        if (poll(&pfd, 1, 0)==1 && (pfd.revents & POLLHUP) && h->head.load()==tail) return 0;
+        uint32_t seq = h->data_seq.load();
+        h->reader_waiting.store(1);
+        if (h->head.load()==tail && !h->closed.load()){
+            struct timespec ts = {0, 50*1000*1000};
+            futex_op(&h->data_seq, FUTEX_WAIT, seq, &ts);
+        }
+        h->reader_waiting.store(0);
+    }
+}
+
+// End of stream as producer; as consumer, tell a blocked producer to stop.
+void stage_close(){
+    if (ring_out && !ring_out->closed.exchange(1)) ring_wake(ring_out->data_seq);
+    if (ring_in && ring_in->reader.exchange(RING_CLOSED)!=RING_CLOSED) ring_wake(ring_in->space_seq);
+}
+
+// ---- Structured record batches ----
+// With `set -o structured`, adjacent record-aware builtins (jsonl -> rec,
+// rec -> rec) exchange typed columnar batches instead of text. Text, a TSV
+// with a header row, is produced only where records leave for an external
+// process, a file or the terminal, and parsed only where they come from one.
+
+static set<string> shell_options;
+static bool stage_rec_in = false, stage_rec_out = false;  // set per stage in the child
+
+bool opt_enabled(const string &name){ return shell_options.count(name)>0; }
+
+bool rec_producer(const vector<string> &argv){ return !argv.empty() && (argv[0]=="jsonl" || argv[0]=="rec"); }
+bool rec_consumer(const vector<string> &argv){ return !argv.empty() && argv[0]=="rec"; }
+
+enum ColType : uint8_t { COL_INT = 0, COL_DOUBLE = 1, COL_STR = 2, COL_NONE = 3 };   // COL_NONE: schema only, no value seen yet
+
+struct Column {
+    string name;
+    ColType type = COL_STR;
+    vector<int64_t> ints;
+    vector<double> dbls;
+    vector<uint32_t> offs{0};   // string value k is bytes[offs[k], offs[k+1])
+    string bytes;
+
+    string_view str(size_t k) const { return string_view(bytes).substr(offs[k], offs[k+1]-offs[k]); }
+    void push_str(const char *b, size_t n){ bytes.append(b, n); offs.push_back((uint32_t)bytes.size()); }
+    double num(size_t k) const { return type==COL_INT? (double)ints[k] : dbls[k]; }
+};
+
+struct RecordBatch {
+    vector<Column> cols;
+    size_t rows = 0;
+    int find(const string &name) const {
+        for (size_t c=0;c<cols.size();++c) if (cols[c].name==name) return (int)c;
+        return -1;
+    }
+};
+
+// Narrow a freshly built string column to int64 or double when every value
+// parses. Empty cells are missing values: they do not decide the type and
+// become NaN, which needs a double column. Returns false if every cell was
+// empty (the column is then all NaN).
+static bool infer_type(Column &c, size_t rows){
+    if (c.type!=COL_STR || rows==0) return true;
+    vector<int64_t> iv(rows);
+    bool all_int = true, any = false;
+    for (size_t k=0;k<rows && all_int;++k){
+        string_view s = c.str(k);
+        auto r = from_chars(s.data(), s.data()+s.size(), iv[k]);
+        all_int = !s.empty() && r.ec==errc() && r.ptr==s.data()+s.size();
+    }
+    if (all_int){ c.type = COL_INT; c.ints.swap(iv); c.offs.assign(1, 0); c.bytes.clear(); return true; }
+    vector<double> dv(rows);
+    for (size_t k=0;k<rows;++k){
+        string v(c.str(k));
+        if (v.empty()){ dv[k] = NAN; continue; }
+        char *end;
+        dv[k] = strtod(v.c_str(), &end);
+        if (*end) return true;
+        any = true;
+    }
+    c.type = COL_DOUBLE; c.dbls.swap(dv); c.offs.assign(1, 0); c.bytes.clear();
+    return any;
+}
+
+// Column types are decided by a stream's first batch with a value in the
+// column and kept for the rest of it, so consumers never see a numeric
+// column turn into text.
+// Later batches are converted to that type; an int column widens to double
+// when needed, and cells that are not numbers become NaN (a missing value:
+// printed empty, skipped by aggregations).
+static void fix_types(RecordBatch &rb, vector<ColType> &schema){
+    if (rb.rows==0) return;
+    if (schema.empty()){
+        for (auto &c: rb.cols) schema.push_back(infer_type(c, rb.rows)? c.type : COL_NONE);
+        return;
+    }
+    for (size_t i=0;i<rb.cols.size() && i<schema.size();++i){
+        Column &c = rb.cols[i];
+        if (schema[i]==COL_STR || c.type!=COL_STR) continue;
+        bool any = infer_type(c, rb.rows);
+        if (schema[i]==COL_NONE){ if (any) schema[i] = c.type; continue; }
+        if (c.type==COL_INT && schema[i]==COL_DOUBLE){
+            c.dbls.assign(c.ints.begin(), c.ints.end()); c.ints.clear(); c.type = COL_DOUBLE;
+        } else if (c.type==COL_STR){
+            vector<double> dv(rb.rows);
+            for (size_t k=0;k<rb.rows;++k){
+                string v(c.str(k));
+                char *end;
+                dv[k] = strtod(v.c_str(), &end);
+                if (v.empty() || *end) dv[k] = NAN;
+            }
+            c.type = COL_DOUBLE; c.dbls.swap(dv); c.offs.assign(1, 0); c.bytes.clear();
+        }
+        if (c.type==COL_DOUBLE) schema[i] = COL_DOUBLE;
+    }
+}
+
+static void append_cell(string &out, const Column &c, size_t k){
+    char buf[32];
+    if (c.type==COL_INT) out.append(buf, to_chars(buf, buf+sizeof(buf), c.ints[k]).ptr);
+    else if (c.type==COL_DOUBLE){ if (!std::isnan(c.dbls[k])) out.append(buf, to_chars(buf, buf+sizeof(buf), c.dbls[k]).ptr); }
+    else out.append(c.str(k));
+}
+
+static void put_bytes(string &o, const void *p, size_t n){ o.append((const char*)p, n); }
+
+// Wire format: "RB01", u32 ncols, u64 rows, then per column u32 name length,
+// name, u8 type, u64 payload length, payload (int64[rows] | double[rows] |
+// u32 offsets[rows+1] followed by the string bytes).
+static void batch_encode(const RecordBatch &rb, string &o){
+    uint32_t nc = (uint32_t)rb.cols.size();
+    uint64_t rows = rb.rows;
+    o.append("RB01", 4); put_bytes(o, &nc, 4); put_bytes(o, &rows, 8);
+    for (auto &c: rb.cols){
+        uint32_t nl = (uint32_t)c.name.size();
+        put_bytes(o, &nl, 4); o += c.name; put_bytes(o, &c.type, 1);
+        uint64_t len = c.type==COL_INT? rows*8 : c.type==COL_DOUBLE? rows*8 : (rows+1)*4 + c.bytes.size();
+        put_bytes(o, &len, 8);
+        if (c.type==COL_INT) put_bytes(o, c.ints.data(), rows*8);
+        else if (c.type==COL_DOUBLE) put_bytes(o, c.dbls.data(), rows*8);
+        else { put_bytes(o, c.offs.data(), (rows+1)*4); o += c.bytes; }
+    }
+}
+
+static bool stage_read_full(void *p, size_t n){
+    char *c = (char*)p;
+    while (n>0){
+        ssize_t r = stage_read(c, n);
+        if (r<=0) return false;
+        c += r; n -= (size_t)r;
+    }
+    return true;
+}
+
+// Frames come from another process: every count and length is checked
+// before anything is sized by it. A bad frame ends the stream with a message.
+static const uint32_t BATCH_MAX_COLS = 4096, BATCH_MAX_NAME = 4096;
+static const uint64_t BATCH_MAX_ROWS = 1u<<24;
+
+static bool batch_corrupt(const char *why){
+    cerr<<"rec: corrupt record batch ("<<why<<")\n";
+    return false;
+}
+
+static bool batch_decode(RecordBatch &rb){
+    char magic[4]; uint32_t nc; uint64_t rows;
+    if (!stage_read_full(magic, 4)) return false;   // clean end of stream
+    if (memcmp(magic, "RB01", 4)!=0) return batch_corrupt("magic");
+    if (!stage_read_full(&nc, 4) || !stage_read_full(&rows, 8)) return batch_corrupt("short header");
+    if (nc>BATCH_MAX_COLS || rows>BATCH_MAX_ROWS) return batch_corrupt("size");
+    rb.cols.assign(nc, Column()); rb.rows = rows;
+    for (auto &c: rb.cols){
+        uint32_t nl; uint64_t len;
+        if (!stage_read_full(&nl, 4) || nl>BATCH_MAX_NAME) return batch_corrupt("name");
+        c.name.resize(nl);
+        if (!stage_read_full(&c.name[0], nl) || !stage_read_full(&c.type, 1) || !stage_read_full(&len, 8)) return batch_corrupt("short column");
+        if (c.type==COL_INT || c.type==COL_DOUBLE){
+            if (len!=rows*8) return batch_corrupt("length");
+            void *dst = c.type==COL_INT? (c.ints.resize(rows), (void*)c.ints.data()) : (c.dbls.resize(rows), (void*)c.dbls.data());
+            if (!stage_read_full(dst, rows*8)) return batch_corrupt("short column");
+        } else if (c.type==COL_STR){
+            uint64_t ol = (rows+1)*4;
+            if (len<ol || len-ol>UINT32_MAX) return batch_corrupt("length");
+            c.offs.resize(rows+1);
+            if (!stage_read_full(c.offs.data(), ol)) return batch_corrupt("short column");
+            if (c.offs[0]!=0 || c.offs[rows]!=len-ol) return batch_corrupt("offsets");
+            for (uint64_t k=0;k<rows;++k) if (c.offs[k]>c.offs[k+1]) return batch_corrupt("offsets");
+            c.bytes.resize(len-ol);
+            if (!stage_read_full(&c.bytes[0], c.bytes.size())) return batch_corrupt("short column");
+        } else return batch_corrupt("type");
+    }
+    return true;
+}
+
+// Where a stage's records go: batches to a record consumer, TSV otherwise.
+struct RecordSink {
+    bool header_done = false;
+    vector<ColType> schema;   // for producers that build batches from text
+    bool emit(const RecordBatch &rb){
+        string out;
+        if (stage_rec_out) batch_encode(rb, out);
+        else {
+            if (!header_done){
+                for (size_t c=0;c<rb.cols.size();++c){ if (c) out.push_back('\t'); out += rb.cols[c].name; }
+                out.push_back('\n');
+                header_done = true;
+            }
+            for (size_t k=0;k<rb.rows;++k){
+                for (size_t c=0;c<rb.cols.size();++c){ if (c) out.push_back('\t'); append_cell(out, rb.cols[c], k); }
+                out.push_back('\n');
+            }
+        }
+        return stage_write(out.data(), out.size());
+    }
+};
+
+// Where a stage's records come from: batches from a producer, TSV otherwise.
+struct RecordSource {
+    vector<string> names;
+    vector<ColType> schema;
+    string buf;
+    size_t pos = 0;
+    bool eof = false;
+
+    bool read_line(string &line){
+        while (true){
+            size_t nl = buf.find('\n', pos);
+            if (nl!=string::npos){ line.assign(buf, pos, nl-pos); pos = nl+1; return true; }
+            if (eof){
+                if (pos>=buf.size()) return false;
+                line.assign(buf, pos, string::npos); pos = buf.size(); return true;
+            }
+            buf.erase(0, pos); pos = 0;
+            char tmp[1<<16];
+            ssize_t r = stage_read(tmp, sizeof(tmp));
+            if (r<=0) eof = true; else buf.append(tmp, (size_t)r);
+        }
+    }
+
+    bool next(RecordBatch &rb){
+        if (stage_rec_in) return batch_decode(rb);
+        string line;
+        if (names.empty()){
+            if (!read_line(line)) return false;
+            size_t a = 0, b;
+            while ((b = line.find('\t', a))!=string::npos){ names.push_back(line.substr(a, b-a)); a = b+1; }
+            names.push_back(line.substr(a));
+        }
+        rb = RecordBatch();
+        for (auto &n: names){ rb.cols.emplace_back(); rb.cols.back().name = n; }
+        while (rb.rows<65536 && read_line(line)){
+            size_t a = 0;
+            for (size_t c=0;c<names.size();++c){
+                size_t b = c+1<names.size()? line.find('\t', a) : string::npos;
+                if (b==string::npos) b = line.size();
+                if (a>line.size()) a = line.size();
+                rb.cols[c].push_str(line.data()+a, b-a);
+                a = b+1;
+            }
+            rb.rows++;
+        }
+        if (rb.rows==0) return false;
+        fix_types(rb, schema);
+        return true;
+    }
+};
+
+static RecordBatch take_rows(const RecordBatch &rb, const vector<uint32_t> &sel){
+    RecordBatch out;
+    out.rows = sel.size();
+    for (auto &c: rb.cols){
+        Column n; n.name = c.name; n.type = c.type;
+        for (uint32_t k: sel){
+            if (c.type==COL_INT) n.ints.push_back(c.ints[k]);
+            else if (c.type==COL_DOUBLE) n.dbls.push_back(c.dbls[k]);
+            else { string_view s = c.str(k); n.push_str(s.data(), s.size()); }
+        }
+        out.cols.push_back(move(n));
+    }
+    return out;
+}
+
+static bool rec_compare(const Column &c, size_t k, const string &op, const string &v, double vnum, bool vis_num){
+    int cmp;
+    if (c.type!=COL_STR && vis_num && !std::isnan(c.num(k))){ double x = c.num(k); cmp = x<vnum? -1 : (x>vnum? 1 : 0); }
+    else { string cell; append_cell(cell, c, k); cmp = cell.compare(v); cmp = cmp<0? -1 : (cmp>0? 1 : 0); }
+    if (op=="=" || op=="eq") return cmp==0;
+    if (op=="!=" || op=="ne") return cmp!=0;
+    if (op=="lt") return cmp<0;
+    if (op=="le") return cmp<=0;
+    if (op=="gt") return cmp>0;
+    return cmp>=0; // ge
+}
+
+// rec select f... | rec where f op v | rec sum|min|max|avg f | rec count [f]
+// op is one of = != eq ne lt le gt ge (< and > are redirections).
+int rec_builtin(const vector<string> &argv){
+    static const set<string> ops = {"=", "!=", "eq", "ne", "lt", "le", "gt", "ge"};
+    string op = argv.size()>1? argv[1] : "";
+    bool agg = op=="sum" || op=="min" || op=="max" || op=="avg";
+    if (!((op=="select" && argv.size()>2) || (op=="where" && argv.size()==5 && ops.count(argv[3])) ||
+          (agg && argv.size()==3) || (op=="count" && argv.size()<=3))){
+        cerr<<"usage: rec select f... | where f op v | sum|min|max|avg f | count [f]\n";
+        return 1;
+    }
+    stage_attach();
+    RecordSource src; RecordSink sink; RecordBatch rb;
+    int rc = 0;
+    double acc = op=="min"? INFINITY : (op=="max"? -INFINITY : 0);
+    uint64_t total = 0;
+    vector<string> group_order; unordered_map<string, int64_t> groups;
+    char *end;
+    double vnum = op=="where"? strtod(argv[4].c_str(), &end) : 0;
+    bool vis_num = op=="where" && !argv[4].empty() && *end==0;
+
+    while (rc==0 && src.next(rb)){
+        if (op=="select"){
+            RecordBatch pb; pb.rows = rb.rows;
+            for (size_t i=2;i<argv.size();++i){
+                int c = rb.find(argv[i]);
+                if (c<0){ cerr<<"rec: no field "<<argv[i]<<"\n"; rc = 1; break; }
+                pb.cols.push_back(rb.cols[c]);
+            }
+            if (rc==0 && !sink.emit(pb)) rc = 1;
+            continue;
+        }
+        if (op=="count" && argv.size()==2){ total += rb.rows; continue; }
+        int c = rb.find(argv[2]);
+        if (c<0){ cerr<<"rec: no field "<<argv[2]<<"\n"; rc = 1; break; }
+        const Column &col = rb.cols[c];
+        if (op=="where"){
+            vector<uint32_t> sel;
+            for (size_t k=0;k<rb.rows;++k) if (rec_compare(col, k, argv[3], argv[4], vnum, vis_num)) sel.push_back((uint32_t)k);
+            if (!sink.emit(take_rows(rb, sel))) rc = 1;
+        } else if (op=="count"){
+            for (size_t k=0;k<rb.rows;++k){
+                string key; append_cell(key, col, k);
+                auto it = groups.find(key);
+                if (it==groups.end()){ group_order.push_back(key); groups.emplace(key, 1); }
+                else it->second++;
+            }
+        } else {
+            if (col.type==COL_STR){ cerr<<"rec: field "<<argv[2]<<" is not numeric\n"; rc = 1; break; }
+            for (size_t k=0;k<rb.rows;++k){
+                double x = col.num(k);
+                if (std::isnan(x)) continue;   // missing value
+                if (op=="min") acc = min(acc, x); else if (op=="max") acc = max(acc, x); else acc += x;
+                total++;
+            }
+        }
+    }
+
+    if (rc==0 && (agg || op=="count")){
+        RecordBatch out; out.rows = 1;
+        Column v;
+        if (op=="count" && argv.size()==3){
+            Column k; k.name = argv[2];
+            for (auto &g: group_order){ k.push_str(g.data(), g.size()); v.ints.push_back(groups[g]); }
+            infer_type(k, group_order.size());
+            out.rows = group_order.size();
+            out.cols.push_back(move(k));
+            v.name = "count"; v.type = COL_INT;
+        } else if (op=="count"){
+            v.name = "count"; v.type = COL_INT; v.ints.push_back((int64_t)total);
+        } else {
+            v.name = op+"_"+argv[2]; v.type = COL_DOUBLE;
+            // min, max and avg of no values are missing, not +-inf or 0
+            v.dbls.push_back(op=="sum"? acc : !total? NAN : op=="avg"? acc/total : acc);
+        }
+        out.cols.push_back(move(v));
+        if (!sink.emit(out)) rc = 1;
+    }
+    stage_close();
+    return rc;
+}
+
+// ---- JSON-lines field extraction ----
+// jsonl [-j|-H] [-P threads] [-w path=value]... path...
+// Prints the selected fields of each JSON line on stdin as TSV (with a
+// header row for -H) or compact JSON objects with -j, or as record batches
+// when feeding rec in structured mode. Paths are dotted keys into nested objects; -w keeps
+// only lines where the field equals value. A regular-file stdin is mmap'd and
+// scanned in newline-aligned chunks by several threads. Speaks the
+// shared-memory stage transport on either end when it is offered.
+
+// Returns the closing quote of a string whose body starts at p (or e).
+// Structural scan: 16 bytes at a time looking for '"' or '\\'.
+static const char* json_string_end(const char *p, const char *e){
+#ifdef __SSE2__
+    const __m128i q = _mm_set1_epi8('"'), bs = _mm_set1_epi8('\\');
+    while (p+16<=e){
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        unsigned m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v,q), _mm_cmpeq_epi8(v,bs)));
+        if (!m){ p += 16; continue; }
+        p += __builtin_ctz(m);
+        if (*p=='"') return p;
+        p += 2; // escaped char
+    }
+#endif
+    while (p<e){
+        if (*p=='"') return p;
+        if (*p=='\\') p++;
+        p++;
+    }
+    return e;
+}
+
+static const char* json_ws(const char *p, const char *e){
+    while (p<e && (*p==' ' || *p=='\t' || *p=='\r' || *p=='\n')) p++;
+    return p;
+}
+
+// Skip one value starting at p; returns one past its end.
+static const char* json_skip(const char *p, const char *e){
+    if (p>=e) return e;
+    if (*p=='"'){ p = json_string_end(p+1, e); return p<e? p+1 : e; }
+    if (*p=='{' || *p=='['){
+        int depth = 0;
+        while (p<e){
+            char c = *p;
+            if (c=='"'){ p = json_string_end(p+1, e); if (p<e) p++; continue; }
+            if (c=='{' || c=='[') depth++;
+            else if ((c=='}' || c==']') && --depth==0) return p+1;
+            p++;
+        }
+        return e;
+    }
+    while (p<e && *p!=',' && *p!='}' && *p!=']' && !isspace((unsigned char)*p)) p++;
+    return p;
+}
+
+// Find path[depth..] in the object at p; on success [vb,ve) is the raw value.
+static bool json_lookup(const char *p, const char *e, const vector<string> &path, size_t depth,
+                        const char *&vb, const char *&ve){
+    p = json_ws(p, e);
+    if (p>=e || *p!='{') return false;
+    p++;
+    while (true){
+        p = json_ws(p, e);
+        if (p>=e || *p!='"') return false;
+        const char *kb = p+1, *ke = json_string_end(kb, e);
+        if (ke>=e) return false;
+        p = json_ws(ke+1, e);
+        if (p>=e || *p!=':') return false;
+        const char *val = json_ws(p+1, e);
+        p = json_skip(val, e);
+        const string &want = path[depth];
+        if ((size_t)(ke-kb)==want.size() && memcmp(kb, want.data(), want.size())==0){
+            if (depth+1==path.size()){ vb = val; ve = p; return true; }
+            return json_lookup(val, p, path, depth+1, vb, ve);
+        }
+        p = json_ws(p, e);
+        if (p>=e || *p!=',') return false;
+        p++;
+    }
+}
+
+static vector<string> split_path(const string &s){
+    vector<string> parts;
+    size_t a = 0, b;
+    while ((b = s.find('.', a))!=string::npos){ parts.push_back(s.substr(a, b-a)); a = b+1; }
+    parts.push_back(s.substr(a));
+    return parts;
+}
+
+struct JsonlSpec {
+    vector<string> names;
+    vector<vector<string>> paths;
+    vector<pair<vector<string>, string>> where;
+    bool json = false;
+    bool header = false;
+};
+
+static void utf8_put(string &out, uint32_t c){
+    if (c<0x80) out.push_back((char)c);
+    else if (c<0x800){ out.push_back((char)(0xC0|c>>6)); out.push_back((char)(0x80|(c&0x3F))); }
+    else if (c<0x10000){ out.push_back((char)(0xE0|c>>12)); out.push_back((char)(0x80|(c>>6&0x3F))); out.push_back((char)(0x80|(c&0x3F))); }
+    else { out.push_back((char)(0xF0|c>>18)); out.push_back((char)(0x80|(c>>12&0x3F))); out.push_back((char)(0x80|(c>>6&0x3F))); out.push_back((char)(0x80|(c&0x3F))); }
+}
+
+static int hex4(const char *p, const char *e){
+    if (e-p<4) return -1;
+    int v = 0;
+    for (int i=0;i<4;++i){
+        char c = p[i];
+        int d = c>='0' && c<='9'? c-'0' : c>='a' && c<='f'? c-'a'+10 : c>='A' && c<='F'? c-'A'+10 : -1;
+        if (d<0) return -1;
+        v = v*16+d;
+    }
+    return v;
+}
+
+// Append a raw value as text: a string is unquoted and its escapes decoded
+// (\uXXXX to UTF-8, surrogate pairs joined, bad ones as U+FFFD); other
+// values are copied as-is. With tsv, tab, newline, CR and backslash in the
+// decoded text are written as \t \n \r \\ (jq's @tsv convention) so a field
+// can never split a row.
+static void json_text(const char *vb, const char *ve, string &out, bool tsv){
+    if (ve-vb<2 || *vb!='"'){ out.append(vb, ve); return; }
+    vb++; ve--;
+    if (!memchr(vb, '\\', ve-vb) && (!tsv || none_of(vb, ve, [](char c){ return c=='\t' || c=='\n' || c=='\r'; }))){
+        out.append(vb, ve);
+        return;
+    }
+    auto put = [&](char c){
+        if (!tsv) { out.push_back(c); return; }
+        switch (c){
+        case '\t': out += "\\t"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\\': out += "\\\\"; break;
+        default: out.push_back(c);
+        }
+    };
+    for (const char *p=vb;p<ve;++p){
+        if (*p!='\\' || p+1>=ve){ put(*p); continue; }
+        char c = *++p;
+        switch (c){
+        case 'n': put('\n'); break;
+        case 't': put('\t'); break;
+        case 'r': put('\r'); break;
+        case 'b': put('\b'); break;
+        case 'f': put('\f'); break;
+        case 'u': {
+            int u = hex4(p+1, ve);
+            if (u<0){ put('\\'); put('u'); break; }
+            p += 4;
+            uint32_t cp = (uint32_t)u;
+            if (cp>=0xD800 && cp<0xDC00){
+                int lo = p+2<ve && p[1]=='\\' && p[2]=='u'? hex4(p+3, ve) : -1;
+                if (lo>=0xDC00 && lo<0xE000){ cp = 0x10000+((cp-0xD800)<<10)+(uint32_t)(lo-0xDC00); p += 6; }
+                else cp = 0xFFFD;
+            } else if (cp>=0xDC00 && cp<0xE000) cp = 0xFFFD;
+            utf8_put(out, cp);
+            break;
+        }
+        default: put(c);   // \" \\ \/
+        }
+    }
+}
+
+// Process the complete lines in [b,e), appending output records to out, or
+// to the columns of rb when it is given.
+static void jsonl_chunk(const JsonlSpec &sp, const char *b, const char *e, string &out, RecordBatch *rb){
+    string text;
+    while (b<e){
+        const char *nl = (const char*)memchr(b, '\n', e-b);
+        const char *le = nl? nl : e;
+        bool keep = json_ws(b, le)<le;
+        for (size_t k=0;keep && k<sp.where.size();++k){
+            const char *vb, *ve;
+            if (!json_lookup(b, le, sp.where[k].first, 0, vb, ve)) { keep = false; break; }
+            text.clear();
+            json_text(vb, ve, text, false);
+            keep = text==sp.where[k].second;
+        }
+        if (keep && rb){
+            for (size_t k=0;k<sp.paths.size();++k){
+                const char *vb, *ve;
+                text.clear();
+                if (json_lookup(b, le, sp.paths[k], 0, vb, ve)) json_text(vb, ve, text, true);
+                rb->cols[k].push_str(text.data(), text.size());
+            }
+            rb->rows++;
+        } else if (keep){
+            if (sp.json) out.push_back('{');
+            for (size_t k=0;k<sp.paths.size();++k){
+                const char *vb, *ve;
+                bool found = json_lookup(b, le, sp.paths[k], 0, vb, ve);
+                if (sp.json){
+                    if (k) out.push_back(',');
+                    out.push_back('"'); out += sp.names[k]; out += "\":";
+                    if (found) out.append(vb, ve); else out += "null";
+                } else {
+                    if (k) out.push_back('\t');
+                    if (found) json_text(vb, ve, out, true);
+                }
+            }
+            if (sp.json) out.push_back('}');
+            out.push_back('\n');
+        }
+        b = nl? nl+1 : e;
+    }
+}
+
+static RecordBatch jsonl_batch(const JsonlSpec &sp){
+    RecordBatch rb;
+    for (auto &n: sp.names){ rb.cols.emplace_back(); rb.cols.back().name = n; }
+    return rb;
+}
+
+// Hand one chunk's output to the next stage.
+static bool jsonl_flush(string &out, RecordBatch *rb, RecordSink &sink, const JsonlSpec &sp){
+    if (!rb){ bool ok = stage_write(out.data(), out.size()); out.clear(); return ok; }
+    fix_types(*rb, sink.schema);
+    bool ok = rb->rows==0 || sink.emit(*rb);
+    *rb = jsonl_batch(sp);
+    return ok;
+}
+
+static int jsonl_run(const JsonlSpec &sp, unsigned nthreads){
+    RecordSink sink;
+    if (sp.header && !stage_rec_out){
+        string h;
+        for (size_t k=0;k<sp.names.size();++k){ if (k) h.push_back('\t'); h += sp.names[k]; }
+        h.push_back('\n');
+        stage_write(h.data(), h.size());
+    }
+    sink.header_done = true;
+    struct stat st;
+    off_t start = lseek(STDIN_FILENO, 0, SEEK_CUR);
+    if (!ring_in && fstat(STDIN_FILENO, &st)==0 && S_ISREG(st.st_mode) && start>=0 && st.st_size>start){
+        size_t size = (size_t)st.st_size;
+        void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, STDIN_FILENO, 0);
+        if (map!=MAP_FAILED){
+            lseek(STDIN_FILENO, st.st_size, SEEK_SET);   // consumed, as a read loop would leave it
+            madvise(map, size, MADV_SEQUENTIAL);
+            const char *base = (const char*)map, *end = base+size, *p = base+start;
+            const size_t chunk = 16u<<20;  // per thread per round; bounds buffered output
+            vector<string> outs(nthreads);
+            vector<RecordBatch> batches(stage_rec_out? nthreads : 0, jsonl_batch(sp));
+            auto batch = [&](size_t t){ return stage_rec_out? &batches[t] : nullptr; };
+            while (p<end){
+                vector<pair<const char*,const char*>> parts;
+                for (unsigned t=0;t<nthreads && p<end;++t){
+                    const char *ce = (size_t)(end-p)>chunk? p+chunk : end;
+                    if (ce<end){
+                        const char *nl = (const char*)memchr(ce, '\n', end-ce);
+                        ce = nl? nl+1 : end;
+                    }
+                    parts.push_back({p, ce});
+                    p = ce;
+                }
+                if (parts.size()==1) jsonl_chunk(sp, parts[0].first, parts[0].second, outs[0], batch(0));
+                else {
+                    vector<thread> workers;
+                    for (size_t t=0;t<parts.size();++t)
+                        workers.emplace_back(jsonl_chunk, cref(sp), parts[t].first, parts[t].second, ref(outs[t]), batch(t));
+                    for (auto &w: workers) w.join();
+                }
+                for (size_t t=0;t<parts.size();++t){
+                    if (!jsonl_flush(outs[t], batch(t), sink, sp)){ munmap(map, size); return 1; }
+                }
+            }
+            munmap(map, size);
+            return 0;
+        }
+    }
+
+    // pipe or terminal: stream complete lines through a single scanner
+    vector<char> buf(1u<<20);
+    size_t have = 0;
+    string out;
+    RecordBatch rbs = jsonl_batch(sp);
+    RecordBatch *rb = stage_rec_out? &rbs : nullptr;
+    while (true){
+        if (have==buf.size()) buf.resize(buf.size()*2);  // line longer than the buffer
+        ssize_t r = stage_read(buf.data()+have, buf.size()-have);
+        if (r<0){ perror("jsonl: read"); return 1; }
+        if (r==0) break;
+        have += (size_t)r;
+        const char *b = buf.data();
+        const char *last = (const char*)memrchr(b, '\n', have);
+        if (!last) continue;
+        size_t used = (size_t)(last-b)+1;
+        jsonl_chunk(sp, b, b+used, out, rb);
+        memmove(buf.data(), b+used, have-used);
+        have -= used;
+        if (!jsonl_flush(out, rb, sink, sp)) return 1;
+    }
+    jsonl_chunk(sp, buf.data(), buf.data()+have, out, rb);
+    return jsonl_flush(out, rb, sink, sp)? 0 : 1;
+}
+
+int jsonl_builtin(const vector<string> &argv){
+    JsonlSpec sp;
+    unsigned nthreads = max(1u, thread::hardware_concurrency());
+    for (size_t i=1;i<argv.size();++i){
+        const string &a = argv[i];
+        if (a=="-j") sp.json = true;
+        else if (a=="-H") sp.header = true;
+        else if (a=="-P" && i+1<argv.size()) nthreads = (unsigned)max(1, atoi(argv[++i].c_str()));
+        else if (a=="-w" && i+1<argv.size()){
+            string w = argv[++i];
+            size_t eq = w.find('=');
+            if (eq==string::npos){ cerr<<"jsonl: -w expects path=value\n"; return 1; }
+            sp.where.push_back({split_path(w.substr(0, eq)), w.substr(eq+1)});
+        } else { sp.names.push_back(a); sp.paths.push_back(split_path(a)); }
+    }
+    if (sp.paths.empty()){ cerr<<"usage: jsonl [-j|-H] [-P threads] [-w path=value]... path...\n"; return 1; }
+    stage_attach();
+    int rc = jsonl_run(sp, nthreads);
+    stage_close();
+    return rc;
+}
+
+// ---- Command output cache ----
+// cache [-m] [-e VAR]... -- cmd args...
+// Memoizes stdout and exit status of a command in a content-addressed store
+// ($SIMPLESHELL_CACHE_DIR, else $XDG_CACHE_HOME/simpleshell, else
+// ~/.cache/simpleshell). The key covers argv, cwd, PATH and any -e
+// variables, the executable's identity, the metadata of argument files and
+// the content of stdin (-m: metadata only for a regular-file stdin). A
+// terminal on stdin counts as empty input (the command gets /dev/null), so
+// `cache -- tool args` typed at the prompt memoizes. Hits are replayed with
+// copy_file_range/splice/sendfile; the command never runs. Shell builtins
+// cannot be cached.
+
+// Two independent 64-bit lanes over 8-byte words; not cryptographic.
+struct Hasher {
+    uint64_t a = 0x243F6A8885A308D3ull, b = 0x13198A2E03707344ull, len = 0;
+    static uint64_t mix(uint64_t x){
+        x ^= x>>33; x *= 0xff51afd7ed558ccdull; x ^= x>>33; x *= 0xc4ceb9fe1a85ec53ull; x ^= x>>33;
+        return x;
+    }
+    void add(const void *p, size_t n){
+        const unsigned char *c = (const unsigned char*)p;
+        len += n;
+        for (; n>=8; c+=8, n-=8){
+            uint64_t w; memcpy(&w, c, 8);
+            a = (a ^ w) * 0x9E3779B97F4A7C15ull; a = (a<<31)|(a>>33);
+            b = (b + w) * 0xC2B2AE3D27D4EB4Full; b ^= b>>29;
+        }
+        if (n){
+            uint64_t w = 0; memcpy(&w, c, n);
+            a = (a ^ w ^ (n<<56)) * 0x9E3779B97F4A7C15ull; b = (b + w) * 0xC2B2AE3D27D4EB4Full;
+        }
+    }
+    void add_str(const string &s){ uint64_t n = s.size(); add(&n, 8); add(s.data(), s.size()); }
+    void add_stat(const struct stat &st){
+        uint64_t v[5] = {(uint64_t)st.st_dev, (uint64_t)st.st_ino, (uint64_t)st.st_size,
+                         (uint64_t)st.st_mtim.tv_sec, (uint64_t)st.st_mtim.tv_nsec};
+        add(v, sizeof(v));
+    }
+    string hex(){
+        char buf[33];
+        snprintf(buf, sizeof(buf), "%016llx%016llx", (unsigned long long)mix(a^len), (unsigned long long)mix(b+len));
+        return buf;
+    }
+};
+
+static void mkdir_p(const string &dir){
+    for (size_t i=1;i<=dir.size();++i)
+        if (i==dir.size() || dir[i]=='/') mkdir(dir.substr(0, i).c_str(), 0755);
+}
+
+string cache_dir(){
+    if (const char *d = getenv("SIMPLESHELL_CACHE_DIR")) return d;
+    if (const char *x = getenv("XDG_CACHE_HOME")) return string(x)+"/simpleshell";
+    const char *home = getenv("HOME");
+    return string(home? home : "/tmp")+"/.cache/simpleshell";
+}
+
+// Resolve a command name the way execvp would.
+string find_in_path(const string &name){
+    if (name.find('/')!=string::npos) return access(name.c_str(), X_OK)==0? name : "";
+    const char *path = getenv("PATH");
+    string p = path? path : "/usr/bin:/bin";
+    size_t a = 0;
+    while (a<=p.size()){
+        size_t b = p.find(':', a);
+        if (b==string::npos) b = p.size();
+        string cand = (b>a? p.substr(a, b-a) : ".")+"/"+name;
+        struct stat st;
+        if (stat(cand.c_str(), &st)==0 && S_ISREG(st.st_mode) && access(cand.c_str(), X_OK)==0) return cand;
+        a = b+1;
+    }
+    return "";
+}
+
+// Copy all of in_fd (a regular file) to out_fd using the cheapest kernel path.
+static bool replay_file(int in_fd, int out_fd){
+    struct stat st;
+    if (fstat(in_fd, &st)<0) return false;
+    off_t off = 0, size = st.st_size;
+    struct stat ost;
+    fstat(out_fd, &ost);
+    while (off<size){
+        ssize_t n = -1;
+        size_t want = (size_t)(size-off);
+        if (S_ISREG(ost.st_mode)) n = copy_file_range(in_fd, &off, out_fd, nullptr, want, 0);
+        else if (S_ISFIFO(ost.st_mode)){ loff_t lo = off; n = splice(in_fd, &lo, out_fd, nullptr, want, 0); if (n>0) off = lo; }
+        if (n<0) n = sendfile(out_fd, in_fd, &off, want);
+        if (n<0){
+            if (errno==EINTR) continue;
+            char buf[65536];
+            n = pread(in_fd, buf, sizeof(buf), off);
+            if (n<=0 || !write_all(out_fd, buf, (size_t)n)) return false;
+            off += n;
+        } else if (n==0) break;
+    }
+    return true;
+}
+
+// Hash fd's unread content: a regular file via mmap, leaving its offset
+// alone; anything else is read through and spooled into spool_fd.
+static bool hash_stream(Hasher &h, int fd, int spool_fd){
+    struct stat st;
+    off_t off = lseek(fd, 0, SEEK_CUR);
+    if (spool_fd<0 && fstat(fd, &st)==0 && S_ISREG(st.st_mode) && off>=0){
+        if (st.st_size<=off) return true;
+        void *m = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m==MAP_FAILED) return false;
+        madvise(m, (size_t)st.st_size, MADV_SEQUENTIAL);
+        h.add((const char*)m+off, (size_t)(st.st_size-off));
+        munmap(m, (size_t)st.st_size);
+        return true;
+    }
+    char buf[65536];
+    while (true){
+        ssize_t r = read(fd, buf, sizeof(buf));
+        if (r<0){ if (errno==EINTR) continue; return false; }
+        if (r==0) return true;
+        h.add(buf, (size_t)r);
+        if (!write_all(spool_fd, buf, (size_t)r)) return false;
+    }
+}
+
+int cache_builtin(const vector<string> &argv){
+    bool meta_only = false;
+    vector<string> envs = {"PATH"};
+    size_t i = 1;
+    for (; i<argv.size(); ++i){
+        if (argv[i]=="--"){ ++i; break; }
+        if (argv[i]=="-m") meta_only = true;
+        else if (argv[i]=="-e" && i+1<argv.size()) envs.push_back(argv[++i]);
+        else break;
+    }
+    if (i>=argv.size()){ cerr<<"usage: cache [-m] [-e VAR]... -- cmd args...\n"; return 1; }
+    vector<string> cmd(argv.begin()+i, argv.end());
+    if (is_builtin(cmd)){ cerr<<"cache: "<<cmd[0]<<" is a shell builtin; only external commands can be cached\n"; return 1; }
+    auto run = [&](){ auto a = make_argv(cmd); execvp(a[0], a.data()); perror("cache: execvp"); _exit(127); };
+    if (isatty(STDIN_FILENO)){
+        int null = open("/dev/null", O_RDONLY);
+        if (null>=0){ dup2(null, STDIN_FILENO); close(null); }
+    }
+    string exe = find_in_path(cmd[0]);
+    struct stat st, in_st;
+    if (exe.empty() || stat(exe.c_str(), &st)<0 || fstat(STDIN_FILENO, &in_st)<0) run();
+
+    Hasher h;
+    for (auto &a: cmd) h.add_str(a);
+    char cwd[4096]; h.add_str(getcwd(cwd, sizeof(cwd))? cwd : "");
+    for (auto &e: envs){ const char *v = getenv(e.c_str()); h.add_str(e+(v? string("=")+v : string("\x01unset"))); }
+    h.add_str(exe); h.add_stat(st);
+    for (size_t k=1;k<cmd.size();++k){ struct stat fs; if (stat(cmd[k].c_str(), &fs)==0 && S_ISREG(fs.st_mode)) h.add_stat(fs); }
+
+    string dir = cache_dir();
+    mkdir_p(dir);
+    int spool = -1;
+    if (S_ISREG(in_st.st_mode) && meta_only) h.add_stat(in_st);
+    else {
+        if (!S_ISREG(in_st.st_mode)){
+            string tmpl = dir+"/stdin.XXXXXX";
+            spool = mkstemp(&tmpl[0]);
+            if (spool<0){ perror("cache: mkstemp"); run(); }
+            unlink(tmpl.c_str());
+        }
+        if (!hash_stream(h, STDIN_FILENO, spool)){ perror("cache: stdin"); return 1; }
+        if (spool>=0){ lseek(spool, 0, SEEK_SET); dup2(spool, STDIN_FILENO); close(spool); }
+    }
+    string key = dir+"/"+h.hex();
+
+    // hit: replay stored stdout and status
+    int ofd = open((key+".out").c_str(), O_RDONLY);
+    FILE *sf = fopen((key+".status").c_str(), "r");
+    int status;
+    if (ofd>=0 && sf && fscanf(sf, "%d", &status)==1){
+        fclose(sf);
+        bool ok = replay_file(ofd, STDOUT_FILENO);
+        close(ofd);
+        return ok? status : 1;
+    }
+    if (ofd>=0) close(ofd);
+    if (sf) fclose(sf);
+
+    // miss: run with stdout teed into the store, then commit status and output
+    string tmp = key+".tmp.XXXXXX";
+    int tfd = mkstemp(&tmp[0]);
+    int p[2];
+    if (tfd<0 || pipe(p)<0){ perror("cache"); run(); }
+    pid_t pid = fork();
+    if (pid<0){ perror("cache: fork"); return 1; }
+    if (pid==0){
+        journal_detach();
+        dup2(p[1], STDOUT_FILENO); close(p[0]); close(p[1]); close(tfd);
+        signal(SIGTTOU, SIG_DFL); signal(SIGTTIN, SIG_DFL);   // ignored dispositions survive exec
+        run();
+    }
+    close(p[1]);
+    char buf[65536];
+    bool stored = true;
+    ssize_t r;
+    while ((r = read(p[0], buf, sizeof(buf)))!=0){
+        if (r<0){ if (errno==EINTR) continue; break; }
+        write_all(STDOUT_FILENO, buf, (size_t)r);
+        stored = stored && write_all(tfd, buf, (size_t)r);
+    }
+    close(p[0]);
+    int ws;
+    while (waitpid(pid, &ws, 0)<0 && errno==EINTR) {}
+    close(tfd);
+    if (!WIFEXITED(ws)){ unlink(tmp.c_str()); return 128+WTERMSIG(ws); }
+    status = WEXITSTATUS(ws);
+    string stmp = key+".status.XXXXXX";   // unique: concurrent misses on one key
+    int sfd = mkstemp(&stmp[0]);
+    FILE *out = sfd>=0? fdopen(sfd, "w") : nullptr;
+    if (stored && out && fprintf(out, "%d\n", status)>0 && fclose(out)==0 && rename(stmp.c_str(), (key+".status").c_str())==0)
+        rename(tmp.c_str(), (key+".out").c_str());
+    else {
+        if (out) fclose(out); else if (sfd>=0) close(sfd);
+        unlink(tmp.c_str());
+        if (sfd>=0) unlink(stmp.c_str());
+    }
+    return status;
+}
+
+// ---- Built-in commands ----
+bool is_builtin(const vector<string> &argv){
+    if (argv.empty()) return false;
+    string cmd = argv[0];
+    return (cmd=="cd" || cmd=="exit" || cmd=="jobs" || cmd=="fg" || cmd=="bg" || cmd=="jsonl" || cmd=="rec" || cmd=="set" || cmd=="cache" || cmd=="tasks" || cmd=="exec-upgrade" || cmd=="stats" || cmd=="metrics" || cmd=="flightrec" || cmd=="shellprof" || cmd=="allocstat" );
+}
+
+int run_builtin(const vector<string> &argv){
+    if (argv.empty()) return 0;
+    string cmd = argv[0];
+    if (cmd=="cd"){
+        const char *path = argv.size()>1 ? argv[1].c_str() : getenv("HOME");
+        if (chdir(path)!=0){ perror("cd"); return 1; }
+        cwd_refresh();
+        return 0;
+    } else if (cmd=="exit"){
+        coalesce_stop();
+        metrics_shutdown();
+        prompt_stop();
+        exit(0);
+    } else if (cmd=="jobs"){
+        if (argv.size()>2 && argv[1]=="--profile"){
+            string s = argv[2]; if (s.size()>0 && s[0]=='%') s = s.substr(1);
+            return job_profile(atoi(s.c_str()), argv.size()>3? atof(argv[3].c_str()) : 3.0);
+        }
+        workers_poll();
+        journal_tick();
+        for (auto &j: jobs){
+            string st = (j.status==0?"Running": (j.status==1?"Stopped":"Done"));
+            if (j.worker==-2 && j.status==0) st = "Queued";
+            cout << "["<<j.id<<"] "<< st << "\t"<< j.cmdline << " (pgid="<< j.pgid<<")";
+            if (j.worker>=0) cout << " [worker "<<j.worker<<"]";
+            cout << "\n";
+        }
+        remove_completed_jobs();
+        return 0;
+    } else if (cmd=="fg"){
+        // fg %jobid or fg jobid or fg default last
+        int id = -1;
+        if (argv.size()>1){ string s = argv[1]; if (s.size()>0 && s[0]=='%') s = s.substr(1); id = stoi(s); }
+        Job *j = (id==-1? find_last_job() : find_job_by_id(id));
+        if (!j){ cerr<<"fg: no such job\n"; return -1; }
+        if (j->worker!=-1){ cerr<<"fg: job runs in the worker pool\n"; return -1; }
+        if (!j->pidfds.empty()){ cerr<<"fg: job was recovered from a previous shell and is not our child\n"; return -1; }
+        // bring to foreground
+        j->is_background = false;
+        int jid = j->id;
+        if (j->coalesced){
+            cerr<<"fg: ["<<jid<<"] output still goes through the coalescing relay, not the terminal\n";
+            coalesce_foreground(jid, true);
+        }
+        sigset_t old;
+        block_sigchld(&old);
+        // send SIGCONT
+        if (kill(-j->pgid, SIGCONT) < 0) perror("kill(SIGCONT)");
+        set_job_status(*j, 0);
+        // give terminal to job
+        tty_handoff(j->pgid);
+        // wait for it
+        wait_for_job(jid);
+        coalesce_foreground(jid, false);
+        // restore terminal control to shell
+        tty_handoff(shell_pgid);
+        sigprocmask(SIG_SETMASK, &old, nullptr);
+        remove_completed_jobs();
+        return 0;
+    } else if (cmd=="bg"){
+        int id = -1;
+        if (argv.size()>1){ string s = argv[1]; if (s.size()>0 && s[0]=='%') s = s.substr(1); id = stoi(s); }
+        Job *j = (id==-1? find_last_job() : find_job_by_id(id));
+        if (!j){ cerr<<"bg: no such job\n"; return -1; }
+        if (j->worker!=-1){ cerr<<"bg: job runs in the worker pool\n"; return -1; }
+        j->is_background = true;
+        if (kill(-j->pgid, SIGCONT) < 0) perror("kill(SIGCONT)");
+        set_job_status(*j, 0);
+        cout<<"["<<j->id<<"] "<< j->cmdline <<" &\n";
+        return 0;
+    } else if (cmd=="jsonl"){
+        return jsonl_builtin(argv);
+    } else if (cmd=="rec"){
+        return rec_builtin(argv);
+    } else if (cmd=="cache"){
+        return cache_builtin(argv);
+    } else if (cmd=="tasks"){
+        return tasks_builtin(argv);
+    } else if (cmd=="exec-upgrade"){
+        return exec_upgrade(argv);
+    } else if (cmd=="stats"){
+        return stats_builtin(argv);
+    } else if (cmd=="metrics"){
+        return metrics_builtin(argv);
+    } else if (cmd=="flightrec"){
+        return flightrec_builtin(argv);
+    } else if (cmd=="shellprof"){
+        return shellprof_builtin(argv);
+    } else if (cmd=="allocstat"){
+        return allocstat_builtin(argv);
+    } else if (cmd=="set"){
+        // set -o name / set +o name; bare `set -o` lists enabled options
+        if (argv.size()==2 && argv[1]=="-o"){ for (auto &o: shell_options) cout<<o<<"\n"; return 0; }
+        if (argv.size()!=3 || (argv[1]!="-o" && argv[1]!="+o")){ cerr<<"usage: set -o|+o option\n"; return -1; }
+        if (argv[1]=="-o") shell_options.insert(argv[2]); else shell_options.erase(argv[2]);
+        return 0;
+    }
+    return 0;
+}
+
+// ---- Execution ----
+
+// Fork every stage of the pipeline into one process group. Fills pids and
+// returns the pgid, or -1 if nothing was started. The caller holds SIGCHLD
+// blocked until the job is in the table so the handler can't miss a reap.
+pid_t spawn_pipeline(vector<Command> &pipeline, bool background, vector<pid_t> &pids){
+    size_t n = pipeline.size();
+    vector<int> pipefds;
+    pipefds.resize((n>1? (n-1)*2:0));
+    for (size_t i=0;i+1<n;++i){ if (pipe(pipefds.data()+2*i) < 0) { perror("pipe"); return -1; } }
+    // optional shared-memory ring alongside pipe i when both ends advertise support
+    vector<int> ringfds(n>1? n-1:0, -1);
+    for (size_t i=0;i+1<n;++i)
+        if (ring_capable(pipeline[i].argv) && ring_capable(pipeline[i+1].argv)) ringfds[i] = ring_create();
+
+    pid_t pgid = 0;
+
+    for (size_t i=0;i<n;++i){
+        // set up fds
+        int in_fd = -1, out_fd = -1;
+        if (i>0) in_fd = pipefds[(i-1)*2];
+        if (i+1<n) out_fd = pipefds[i*2+1];
+
+        uint64_t fork_tick = stat_ticks();
+        pid_t pid = fork();
+        if (pid < 0){ perror("fork"); break; }
+        if (pid==0){
+            // child
+            journal_detach();
+            // set pgid
+            if (pgid==0) pgid = getpid();
+            setpgid(0, pgid);
+            if (!background) tcsetpgrp(STDIN_FILENO, pgid);
+            // restore default signals
+            signal(SIGINT, SIG_DFL);
+            signal(SIGTSTP, SIG_DFL);
+            signal(SIGCHLD, SIG_DFL);
+            signal(SIGQUIT, SIG_DFL);
+            signal(SIGTTOU, SIG_DFL);
+            signal(SIGTTIN, SIG_DFL);
+            sigset_t none; sigemptyset(&none);
+            sigprocmask(SIG_SETMASK, &none, nullptr);
+
+            // input from previous pipe
+            if (in_fd!=-1){ dup2(in_fd, STDIN_FILENO); }
+            // output to next pipe
+            if (out_fd!=-1){ dup2(out_fd, STDOUT_FILENO); }
+            // coalesce: the job's terminal output goes to the shell's relay
+            if (spawn_out!=-1){
+                if (i==n-1) dup2(spawn_out, STDOUT_FILENO);
+                dup2(spawn_out, STDERR_FILENO);
+            }
+            // handle redirection if present (only for endpoints)
+            if (i==0 && !pipeline[i].infile.empty()){
+                int fd = open(pipeline[i].infile.c_str(), O_RDONLY);
+                if (fd<0){ perror("open infile"); exit(1); }
+                dup2(fd, STDIN_FILENO);
+            }
+            if (i==n-1 && !pipeline[i].outfile.empty()){
+                int flags = O_WRONLY | O_CREAT | (pipeline[i].append? O_APPEND: O_TRUNC);
+                int fd = open(pipeline[i].outfile.c_str(), flags, 0644);
+                if (fd<0){ perror("open outfile"); exit(1); }
+                dup2(fd, STDOUT_FILENO);
+            }
+            // close all pipe fds
+            for (int fd: pipefds) if (fd!=-1) close(fd);
+            // record batches instead of text on pipes between record-aware builtins
+            stage_rec_in = opt_enabled("structured") && i>0 && rec_producer(pipeline[i-1].argv) && rec_consumer(pipeline[i].argv);
+            stage_rec_out = opt_enabled("structured") && i+1<n && rec_producer(pipeline[i].argv) && rec_consumer(pipeline[i+1].argv);
+            // export this stage's ring ends, close the rest
+            unsetenv("SIMPLESHELL_RING_IN_FD");
+            unsetenv("SIMPLESHELL_RING_OUT_FD");
+            for (size_t r=0;r<ringfds.size();++r){
+                if (ringfds[r]==-1) continue;
+                if (r+1==i) setenv("SIMPLESHELL_RING_IN_FD", to_string(ringfds[r]).c_str(), 1);
+                else if (r==i) setenv("SIMPLESHELL_RING_OUT_FD", to_string(ringfds[r]).c_str(), 1);
+                else close(ringfds[r]);
+            }
+
+            // hold here until the parent opens the gate (profile)
+            if (spawn_gate[0]>=0){
+                close(spawn_gate[1]);
+                char c;
+                while (read(spawn_gate[0], &c, 1)<0 && errno==EINTR) {}
+                close(spawn_gate[0]);
+            }
+
+            // exec
+            // _exit, not exit: exit() would sync the stdin FILE we share with
+            // the shell and rewind its script fd to where this child stopped
+            if (pipeline[i].argv.empty()) _exit(0);
+            if (is_builtin(pipeline[i].argv)){
+                // execute builtin in child (rare) then exit with its status
+                int rc = run_builtin(pipeline[i].argv) & 0xff;
+                cout.flush(); cerr.flush(); fflush(stdout); fflush(stderr);
+                stage_close();
+                _exit(rc);
+            }
+            uint64_t t = stat_ticks();
+            auto argv = make_argv(pipeline[i].argv);
+            lat_record(LAT_EXPAND, stat_ticks()-t);
+            lat_mark_exec(fork_tick);
+            SHELL_PROBE2(exec, argv[0], i);
+            execvp(argv[0], argv.data());
+            fr_record(FR_EXEC_FAIL, errno, getpid());
+            SHELL_PROBE2(exec__fail, argv[0], errno);
+            perror("execvp");
+            _exit(1);
+        } else {
+            // parent
+            if (pgid==0) pgid = pid;
+            setpgid(pid, pgid);
+            pids.push_back(pid);
+            fr_record(FR_SPAWN, pid, (int64_t)i);
+            SHELL_PROBE3(spawn, pid, pgid, i);
+            stages_spawned_total.fetch_add(1, memory_order_relaxed);
+        }
+    }
+
+    // parent: close pipes
+    for (int fd: pipefds) if (fd!=-1) close(fd);
+    for (int fd: ringfds) if (fd!=-1) close(fd);
+    return pids.empty()? -1 : pgid;
+}
+
+// Wait until job id has no running stages (all exited, or one stopped).
+// SIGCHLD must be blocked so the handler doesn't reap them first.
+void wait_for_job(int id){
+    while (true){
+        Job *j = find_job_by_id(id);
+        if (!j || j->status!=0) return;
+        int status;
+        pid_t w = waitpid(-j->pgid, &status, WUNTRACED);
+        if (w<0){
+            if (errno==EINTR) continue;
+            set_job_status(*j, 2);   // nothing left to wait for
+            return;
+        }
+        job_update(w, status);
+        metrics_tick();
+    }
+}
+
+void block_sigchld(sigset_t *old){
+    sigset_t s; sigemptyset(&s); sigaddset(&s, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &s, old);
+}
+
+void launch_pipeline(vector<Command> &pipeline, bool background, const string &cmdline){
+    sigset_t old;
+    block_sigchld(&old);
+    vector<pid_t> pids;
+    int cpipe[2] = { -1, -1 };
+    if (background && opt_enabled("coalesce") && pipe2(cpipe, O_CLOEXEC)==0) spawn_out = cpipe[1];
+    pid_t pgid = spawn_pipeline(pipeline, background, pids);
+    spawn_out = -1;
+    if (cpipe[1]!=-1) close(cpipe[1]);
+    if (pgid<0){ if (cpipe[0]!=-1) close(cpipe[0]); sigprocmask(SIG_SETMASK, &old, nullptr); last_status = 127; return; }
+
+    // record job
+    int jid = add_job(pgid, cmdline, background, pids);
+    if (cpipe[0]!=-1){ find_job_by_id(jid)->coalesced = true; coalesce_add(cpipe[0], jid); }
+    metrics_tick();
+
+    if (!background){
+        // give terminal to child
+        tty_handoff(pgid);
+        // wait for job to finish or stop
+        wait_for_job(jid);
+
+        // restore terminal to shell
+        tty_handoff(shell_pgid);
+        Job *j = find_job_by_id(jid);
+        if (j && j->status==1){
+            last_status = 128+SIGTSTP;
+            cerr<<"\n["<<jid<<"] Stopped\t"<< cmdline <<"\n";
+        } else {
+            if (j) last_status = WIFSIGNALED(j->exit_status)? 128+WTERMSIG(j->exit_status) : WEXITSTATUS(j->exit_status);
+            remove_completed_jobs();
+        }
+    } else {
+        cout<<"["<<jid<<"] "<<pgid<<"\n"; // print job id and pgid
+    }
+    sigprocmask(SIG_SETMASK, &old, nullptr);
+}
+
+// ---- Task runner ----
+// tasks [-f file] [-j N] [-c] [-B] [-n] [target...]
+// Runs the tasks of an INI-style task file (default ./Tasksfile) as a DAG:
+//   [name]
+//   deps = other tasks
+//   in   = input files (globs allowed)
+//   out  = output files
+//   run  = command line
+// A task with outputs is skipped when its outputs are newer than its inputs
+// (-c: when the inputs' content hash matches the last successful run) and no
+// dependency ran. Ready tasks run as background jobs, at most N at a time,
+// longest remaining path first using durations from file.state. -B forces
+// every task, -n only prints what would run.
+
+struct Task {
+    string name, run;
+    vector<string> deps, in, out;
+    vector<int> dependents;
+    int pending = 0;       // unfinished dependencies
+    double rank = 0;       // own estimate + longest path below it (ms)
+    bool selected = false, dep_ran = false;
+    int job = 0;
+    chrono::steady_clock::time_point started;
+    string inhash;
+};
+
+// Reap every child that changed state and apply it to the job table.
+void reap_children(){
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED | WCONTINUED))>0) job_update(pid, status);
+}
+
+// Sleep until SIGCHLD arrives (SIGCHLD must be blocked), another signal is
+// handled, or timeout_ms passes.
+void wait_sigchld(int timeout_ms){
+    sigset_t s; sigemptyset(&s); sigaddset(&s, SIGCHLD);
+    struct timespec ts = {timeout_ms/1000, (long)(timeout_ms%1000)*1000000};
+    sigtimedwait(&s, nullptr, &ts);
+}
+
+static vector<string> expand_words(const string &v, bool glob_it){
+    vector<string> out;
+    istringstream is(v);
+    string w;
+    while (is>>w){
+        glob_t g;
+        if (glob_it && glob(w.c_str(), GLOB_NOCHECK, nullptr, &g)==0){
+            for (size_t k=0;k<g.gl_pathc;++k) out.push_back(g.gl_pathv[k]);
+            globfree(&g);
+        } else out.push_back(w);
+    }
+    return out;
+}
+
+static bool load_tasks(const string &file, vector<Task> &tasks){
+    ifstream f(file);
+    if (!f){ cerr<<"tasks: cannot open "<<file<<"\n"; return false; }
+    string line;
+    for (int ln=1; getline(f, line); ++ln){
+        line = trim(line);
+        if (line.empty() || line[0]=='#') continue;
+        if (line[0]=='[' && line.back()==']'){ tasks.emplace_back(); tasks.back().name = trim(line.substr(1, line.size()-2)); continue; }
+        size_t eq = line.find('=');
+        if (eq==string::npos || tasks.empty()){ cerr<<"tasks: "<<file<<":"<<ln<<": expected [name] or key = value\n"; return false; }
+        string key = trim(line.substr(0, eq)), val = trim(line.substr(eq+1));
+        Task &t = tasks.back();
+        if (key=="deps") t.deps = expand_words(val, false);
+        else if (key=="in") t.in = expand_words(val, true);
+        else if (key=="out") t.out = expand_words(val, false);
+        else if (key=="run") t.run = val;
+        else { cerr<<"tasks: "<<file<<":"<<ln<<": unknown key "<<key<<"\n"; return false; }
+    }
+    return true;
+}
+
+static string hash_inputs(const Task &t){
+    Hasher h;
+    h.add_str(t.run);
+    for (auto &p: t.in){
+        h.add_str(p);
+        int fd = open(p.c_str(), O_RDONLY);
+        if (fd<0){ h.add_str("\x01missing"); continue; }
+        hash_stream(h, fd, -1);
+        close(fd);
+    }
+    return h.hex();
+}
+
+static bool task_up_to_date(Task &t, bool content, const map<string, pair<double,string>> &hist){
+    if (t.out.empty() || t.dep_ran) return false;
+    struct stat st;
+    struct timespec oldest_out = {LONG_MAX, 0}, newest_in = {0, 0};
+    auto older = [](const struct timespec &a, const struct timespec &b){ return a.tv_sec<b.tv_sec || (a.tv_sec==b.tv_sec && a.tv_nsec<b.tv_nsec); };
+    for (auto &o: t.out){
+        if (stat(o.c_str(), &st)<0) return false;
+        if (older(st.st_mtim, oldest_out)) oldest_out = st.st_mtim;
+    }
+    if (content){
+        auto it = hist.find(t.name);
+        return it!=hist.end() && it->second.second==t.inhash;
+    }
+    for (auto &p: t.in){
+        if (stat(p.c_str(), &st)<0) return false;
+        if (older(newest_in, st.st_mtim)) newest_in = st.st_mtim;
+    }
+    return !older(oldest_out, newest_in);
+}
+
+int tasks_builtin(const vector<string> &argv){
+    string file = "Tasksfile";
+    int max_jobs = 1;
+    bool content = false, force = false, dry = false;
+    vector<string> targets;
+    for (size_t i=1;i<argv.size();++i){
+        const string &a = argv[i];
+        if (a=="-f" && i+1<argv.size()) file = argv[++i];
+        else if (a=="-j" && i+1<argv.size()) max_jobs = max(1, atoi(argv[++i].c_str()));
+        else if (a=="-c") content = true;
+        else if (a=="-B") force = true;
+        else if (a=="-n") dry = true;
+        else targets.push_back(a);
+    }
+    vector<Task> tasks;
+    if (!load_tasks(file, tasks)) return 1;
+    map<string,int> by_name;
+    for (size_t i=0;i<tasks.size();++i) by_name[tasks[i].name] = (int)i;
+
+    // history: name \t duration_ms \t input hash
+    string state_file = file+".state";
+    map<string, pair<double,string>> hist;
+    {
+        ifstream sf(state_file);
+        string name, hash; double ms;
+        while (sf>>name>>ms){ getline(sf, hash); hist[name] = {ms, trim(hash)}; }
+    }
+
+    // select targets and their transitive dependencies
+    vector<int> stack;
+    if (targets.empty()) for (size_t i=0;i<tasks.size();++i) stack.push_back((int)i);
+    for (auto &tn: targets){
+        if (!by_name.count(tn)){ cerr<<"tasks: no task "<<tn<<"\n"; return 1; }
+        stack.push_back(by_name[tn]);
+    }
+    while (!stack.empty()){
+        int i = stack.back(); stack.pop_back();
+        if (tasks[i].selected) continue;
+        tasks[i].selected = true;
+        for (auto &d: tasks[i].deps){
+            if (!by_name.count(d)){ cerr<<"tasks: "<<tasks[i].name<<" depends on unknown task "<<d<<"\n"; return 1; }
+            stack.push_back(by_name[d]);
+        }
+    }
+    for (size_t i=0;i<tasks.size();++i){
+        if (!tasks[i].selected) continue;
+        for (auto &d: tasks[i].deps){ tasks[by_name[d]].dependents.push_back((int)i); tasks[i].pending++; }
+    }
+
+    // topological order (Kahn); leftovers mean a cycle
+    vector<int> order, indeg(tasks.size());
+    for (size_t i=0;i<tasks.size();++i) if (tasks[i].selected){ indeg[i] = tasks[i].pending; if (!indeg[i]) order.push_back((int)i); }
+    for (size_t k=0;k<order.size();++k)
+        for (int d: tasks[order[k]].dependents) if (--indeg[d]==0) order.push_back(d);
+    size_t nsel = count_if(tasks.begin(), tasks.end(), [](const Task &t){ return t.selected; });
+    if (order.size()!=nsel){ cerr<<"tasks: dependency cycle\n"; return 1; }
+
+    // critical path rank from historical durations (unknown tasks: mean of known, else 1s)
+    double known = 0; int nknown = 0;
+    for (auto &h: hist){ known += h.second.first; nknown++; }
+    double fallback = nknown? known/nknown : 1000;
+    for (size_t k=order.size(); k-->0;){
+        Task &t = tasks[order[k]];
+        double below = 0;
+        for (int d: t.dependents) below = max(below, tasks[d].rank);
+        t.rank = (hist.count(t.name)? hist[t.name].first : fallback) + below;
+    }
+
+    priority_queue<pair<double,int>> ready;
+    for (int i: order) if (tasks[i].pending==0) ready.push({tasks[i].rank, i});
+    vector<int> running;
+    int rc = 0, ran = 0, skipped = 0;
+    bool interrupted = false;
+    auto release = [&](Task &t, bool did_run){
+        for (int d: t.dependents){
+            tasks[d].dep_ran = tasks[d].dep_ran || did_run;
+            if (--tasks[d].pending==0) ready.push({tasks[d].rank, d});
+        }
+    };
+
+    sigset_t old;
+    block_sigchld(&old);
+    got_sigint = 0;
+    while (true){
+        while (rc==0 && !got_sigint && (int)running.size()<max_jobs && !ready.empty()){
+            Task &t = tasks[ready.top().second]; ready.pop();
+            if (content) t.inhash = hash_inputs(t);
+            if (!force && task_up_to_date(t, content, hist)){ skipped++; release(t, false); continue; }
+            cout<<"tasks: "<<(dry? "would run " : "running ")<<t.name<<"\n"<<flush;
+            if (dry || t.run.empty()){ ran++; release(t, true); continue; }
+            auto parsed = parse_pipeline(split_tokens(t.run));
+            vector<pid_t> pids;
+            pid_t pgid = parsed.first.empty()? -1 : spawn_pipeline(parsed.first, true, pids);
+            if (pgid<0){ cerr<<"tasks: "<<t.name<<": could not start\n"; rc = 1; break; }
+            t.job = add_job(pgid, t.run, true, pids);
+            t.started = chrono::steady_clock::now();
+            running.push_back((int)(&t-&tasks[0]));
+        }
+        if (running.empty()) break;
+        wait_sigchld(200);
+        reap_children();
+        if (got_sigint && !interrupted){
+            interrupted = true;
+            for (int i: running){ Job *j = find_job_by_id(tasks[i].job); if (j) kill(-j->pgid, SIGINT); }
+        }
+        for (size_t k=0;k<running.size();){
+            Task &t = tasks[running[k]];
+            Job *j = find_job_by_id(t.job);
+            if (j && j->status!=2){ ++k; continue; }
+            int st = j? j->exit_status : 0;
+            running.erase(running.begin()+k);
+            if (WIFEXITED(st) && WEXITSTATUS(st)==0){
+                double ms = chrono::duration<double, milli>(chrono::steady_clock::now()-t.started).count();
+                hist[t.name] = {ms, t.inhash.empty()? "-" : t.inhash};
+                ran++;
+                release(t, true);
+            } else {
+                cerr<<"tasks: "<<t.name<<" failed ("<<(WIFEXITED(st)? "exit "+to_string(WEXITSTATUS(st)) : "signal "+to_string(WTERMSIG(st)))<<")\n";
+                if (rc==0) rc = 1;
+            }
+        }
+        remove_completed_jobs();
+    }
+    sigprocmask(SIG_SETMASK, &old, nullptr);
+    if (interrupted) rc = 130;
+
+    if (!dry){
+        ofstream sf(state_file+".tmp");
+        for (auto &h: hist) sf<<h.first<<"\t"<<h.second.first<<"\t"<<h.second.second<<"\n";
+        sf.close();
+        if (sf) rename((state_file+".tmp").c_str(), state_file.c_str());
+    }
+    cout<<"tasks: "<<ran<<" run, "<<skipped<<" up to date"<<(rc? ", failed" : "")<<"\n";
+    return rc;
+}
+
+// ---- Watch mode ----
+// watch [-p pattern]... [-d ms] [-q] -- cmd | cmd2 ...
+// Runs the pipeline, then re-runs it whenever a file matching a pattern
+// changes. Patterns are dir/glob ("src/*.c") or dir/** for a whole tree
+// (default "**", hidden directories are not descended into). Bursts of
+// events within -d ms (default 100) coalesce into one run. A change while
+// the pipeline is still running restarts it (SIGTERM, then SIGKILL if it
+// is still there after WATCH_KILL_MS), or with -q re-runs it after it
+// finishes. Ctrl-C ends watch. watch runs in the foreground; a trailing &
+// is rejected.
+
+static const int WATCH_KILL_MS = 2000;
+
+struct WatchSpec {
+    string dir;        // directory prefix without glob characters
+    string name_glob;  // basename filter ("" matches everything)
+    bool recursive = false;
+};
+
+static WatchSpec parse_watch_pattern(const string &pat){
+    WatchSpec w;
+    size_t glob_at = pat.find_first_of("*?[");
+    size_t slash = glob_at==string::npos? pat.rfind('/') : pat.rfind('/', glob_at);
+    w.dir = slash==string::npos? "." : (slash==0? "/" : pat.substr(0, slash));
+    string rest = slash==string::npos? pat : pat.substr(slash+1);
+    if (rest.compare(0, 2, "**")==0){
+        w.recursive = true;
+        rest = rest.size()>3 && rest[2]=='/'? rest.substr(3) : "";
+    }
+    if (glob_at==string::npos && !w.recursive){
+        struct stat st;
+        if (stat(pat.c_str(), &st)==0 && S_ISDIR(st.st_mode)){ w.dir = pat; rest = ""; }
+    }
+    w.name_glob = rest;
+    return w;
+}
+
+static void watch_add(int ifd, const string &dir, int spec, bool recursive, map<int, pair<string,int>> &wds){
+    int wd = inotify_add_watch(ifd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE | IN_ONLYDIR);
+    if (wd<0){ perror(("watch: "+dir).c_str()); return; }
+    wds[wd] = {dir, spec};
+    if (!recursive) return;
+    DIR *d = opendir(dir.c_str());
+    if (!d) return;
+    while (struct dirent *e = readdir(d)){
+        if (e->d_name[0]=='.') continue;
+        string sub = dir+"/"+e->d_name;
+        struct stat st;
+        if (lstat(sub.c_str(), &st)==0 && S_ISDIR(st.st_mode)) watch_add(ifd, sub, spec, true, wds);
+    }
+    closedir(d);
+}
+
+static int watch_start(vector<Command> &pipeline, const string &cmdline){
+    vector<pid_t> pids;
+    pid_t pgid = spawn_pipeline(pipeline, false, pids);
+    if (pgid<0) return 0;
+    int jid = add_job(pgid, cmdline, false, pids);
+    tcsetpgrp(STDIN_FILENO, pgid);
+    return jid;
+}
+
+// Terminate the watched job: SIGTERM, escalating to SIGKILL if it outlives
+// WATCH_KILL_MS. SIGCHLD is blocked and read from sfd.
+static void watch_stop(int jid, int sfd){
+    Job *j = find_job_by_id(jid);
+    if (!j || j->status!=0) return;   // a stopped job is left in the table
+    kill(-j->pgid, SIGTERM);
+    auto until = chrono::steady_clock::now()+chrono::milliseconds(WATCH_KILL_MS);
+    while (true){
+        reap_children();
+        j = find_job_by_id(jid);
+        if (!j || j->status==2) return;
+        int left = (int)chrono::duration_cast<chrono::milliseconds>(until-chrono::steady_clock::now()).count();
+        if (left<=0) break;
+        struct pollfd p = { sfd, POLLIN, 0 };
+        if (poll(&p, 1, left)>0){ struct signalfd_siginfo si; while (read(sfd, &si, sizeof(si))==(ssize_t)sizeof(si)) {} }
+    }
+    cerr<<"watch: job ignored SIGTERM, killing it\n";
+    kill(-j->pgid, SIGKILL);
+    wait_for_job(jid);
+}
+
+int watch_pipeline(vector<Command> pipeline, const string &cmdline, bool bg){
+    if (bg){ cerr<<"watch: cannot run in the background (drop the trailing &)\n"; return 1; }
+    vector<string> &first = pipeline[0].argv;
+    vector<WatchSpec> specs;
+    int debounce_ms = 100;
+    bool queue = false;
+    size_t i = 1;
+    for (; i<first.size(); ++i){
+        if (first[i]=="--"){ ++i; break; }
+        if (first[i]=="-p" && i+1<first.size()) specs.push_back(parse_watch_pattern(first[++i]));
+        else if (first[i]=="-d" && i+1<first.size()) debounce_ms = max(0, atoi(first[++i].c_str()));
+        else if (first[i]=="-q") queue = true;
+        else break;
+    }
+    first.erase(first.begin(), first.begin()+i);
+    if (first.empty()){ cerr<<"usage: watch [-p pattern]... [-d ms] [-q] -- cmd | cmd2 ...\n"; return 1; }
+    if (specs.empty()) specs.push_back(parse_watch_pattern("**"));
+
+    int ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (ifd<0){ perror("watch: inotify_init1"); return 1; }
+    map<int, pair<string,int>> wds;  // wd -> (directory, spec)
+    for (size_t s=0;s<specs.size();++s) watch_add(ifd, specs[s].dir, (int)s, specs[s].recursive, wds);
+
+    sigset_t old, chld;
+    block_sigchld(&old);
+    sigemptyset(&chld); sigaddset(&chld, SIGCHLD);
+    int sfd = signalfd(-1, &chld, SFD_NONBLOCK | SFD_CLOEXEC);
+    got_sigint = 0;
+
+    int jid = watch_start(pipeline, cmdline);
+    bool pending = false, rerun = false, quit = false;
+    auto deadline = chrono::steady_clock::now();
+    alignas(struct inotify_event) char buf[16384];
+
+    while (!quit){
+        int timeout = 200;
+        if (pending) timeout = max<int>(0, (int)chrono::duration_cast<chrono::milliseconds>(deadline-chrono::steady_clock::now()).count());
+        struct pollfd pfd[2] = {{ifd, POLLIN, 0}, {sfd, POLLIN, 0}};
+        int pr = poll(pfd, 2, timeout);
+        if (got_sigint) break;
+        if (pr<0 && errno!=EINTR) { perror("watch: poll"); break; }
+
+        if (pr>0 && (pfd[1].revents & POLLIN)){
+            struct signalfd_siginfo si;
+            while (read(sfd, &si, sizeof(si))==(ssize_t)sizeof(si)) {}
+        }
+        reap_children();
+        Job *j = jid? find_job_by_id(jid) : nullptr;
+        if (jid && (!j || j->status!=0)){
+            tcsetpgrp(STDIN_FILENO, shell_pgid);
+            int st = j? j->exit_status : 0;
+            if (j && j->status==1){ cerr<<"\nwatch: job stopped, leaving watch\n"; break; }
+            if (WIFSIGNALED(st) && WTERMSIG(st)==SIGINT){ quit = true; break; }
+            cerr<<"watch: "<<(WIFEXITED(st)? "exit "+to_string(WEXITSTATUS(st)) : "signal "+to_string(WTERMSIG(st)))<<", waiting for changes\n";
+            jid = 0;
+            remove_completed_jobs();
+            if (rerun){ rerun = false; jid = watch_start(pipeline, cmdline); }
+        }
+
+        if (pr>0 && (pfd[0].revents & POLLIN)){
+            ssize_t n;
+            while ((n = read(ifd, buf, sizeof(buf)))>0){
+                for (char *p = buf; p<buf+n; ){
+                    struct inotify_event *ev = (struct inotify_event*)p;
+                    p += sizeof(struct inotify_event)+ev->len;
+                    auto it = wds.find(ev->wd);
+                    if (it==wds.end() || !ev->len) continue;
+                    const WatchSpec &ws = specs[it->second.second];
+                    if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO)) && ws.recursive && ev->name[0]!='.')
+                        watch_add(ifd, it->second.first+"/"+ev->name, it->second.second, true, wds);
+                    if (!ws.name_glob.empty() && fnmatch(ws.name_glob.c_str(), ev->name, 0)!=0) continue;
+                    pending = true;
+                    deadline = chrono::steady_clock::now()+chrono::milliseconds(debounce_ms);
+                }
+            }
+        }
+
+        if (pending && chrono::steady_clock::now()>=deadline){
+            pending = false;
+            Job *cur = jid? find_job_by_id(jid) : nullptr;
+            if (cur && cur->status==0){
+                if (queue){ rerun = true; continue; }
+                cerr<<"watch: change detected, restarting\n";
+                watch_stop(jid, sfd);
+                tcsetpgrp(STDIN_FILENO, shell_pgid);
+                remove_completed_jobs();
+            } else cerr<<"watch: change detected\n";
+            jid = watch_start(pipeline, cmdline);
+        }
+    }
+
+    if (jid) watch_stop(jid, sfd);
+    tcsetpgrp(STDIN_FILENO, shell_pgid);
+    remove_completed_jobs();
+    close(sfd);
+    close(ifd);
+    sigprocmask(SIG_SETMASK, &old, nullptr);
+    return 0;
+}
+
+// ---- Worker shell pool ----
+// workers start N [-s slots] [-a] [-c]  fork N worker shells (-a: pin worker k
+//                                       to CPU k, -c: own cgroup under
+//                                       $SIMPLESHELL_CGROUP or /sys/fs/cgroup/simpleshell)
+// workers run -- cmd | cmd2 ...         submit a background job to the pool
+// workers [status]                      list workers and their load
+// workers stop                          let workers finish their jobs and exit
+// Workers talk to the coordinator over SOCK_SEQPACKET socketpairs with one
+// text message per packet: "RUN <job> <cmdline>" / "QUIT" down, "START <job>
+// <pgid>" / "DONE <job> <status>" up. A job goes to the least-loaded worker
+// with a free slot, otherwise it waits in the coordinator's queue and the
+// next worker to free a slot takes it. Jobs appear in the normal job table;
+// the coordinator drains worker messages before each prompt and in `jobs`.
+
+struct Worker {
+    pid_t pid;
+    int sock;
+    int inflight = 0;
+    int done = 0;
+    bool stopping = false;
+};
+
+static vector<Worker> workers;
+static deque<int> worker_queue;   // job ids waiting for a free slot
+static int worker_slots = 4;
+
+static bool worker_send(int sock, const string &msg){
+    return send(sock, msg.data(), msg.size(), MSG_NOSIGNAL)==(ssize_t)msg.size();
+}
+
+// Worker side: run submitted pipelines with the shell's own launcher and
+// report their lifecycle. Never returns.
+[[noreturn]] static void worker_main(int sock, int index, bool pin, bool cgroup){
+    journal_detach();
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+    setpgid(0, 0);  // keep terminal signals away from the worker
+    int devnull = open("/dev/null", O_RDONLY);
+    if (devnull>=0){ dup2(devnull, STDIN_FILENO); close(devnull); }
+    for (auto &w: workers) close(w.sock);
+    workers.clear(); worker_queue.clear(); jobs.clear();
+    if (pin){
+        cpu_set_t set; CPU_ZERO(&set);
+        CPU_SET(index % max(1, (int)sysconf(_SC_NPROCESSORS_ONLN)), &set);
+        if (sched_setaffinity(0, sizeof(set), &set)<0) perror("worker: sched_setaffinity");
+    }
+    if (cgroup){
+        const char *root = getenv("SIMPLESHELL_CGROUP");
+        string dir = string(root? root : "/sys/fs/cgroup/simpleshell")+"/worker"+to_string(index);
+        mkdir_p(dir);
+        int fd = open((dir+"/cgroup.procs").c_str(), O_WRONLY);
+        if (fd<0 || write(fd, "0", 1)<0) perror(("worker: "+dir).c_str());
+        if (fd>=0) close(fd);
+    }
+
+    sigset_t chld; sigemptyset(&chld); sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, nullptr);
+    int sfd = signalfd(-1, &chld, SFD_NONBLOCK | SFD_CLOEXEC);
+    map<int,int> remote_of;  // local job id -> coordinator job id
+    bool quitting = false;
+    char buf[65536];
+    while (!(quitting && remote_of.empty())){
+        struct pollfd pfd[2] = {{sock, POLLIN, 0}, {sfd, POLLIN, 0}};
+        if (poll(pfd, 2, -1)<0 && errno!=EINTR) break;
+        if (pfd[1].revents & POLLIN){
+            struct signalfd_siginfo si;
+            while (read(sfd, &si, sizeof(si))==(ssize_t)sizeof(si)) {}
+            reap_children();
+            for (auto it = remote_of.begin(); it!=remote_of.end();){
+                Job *j = find_job_by_id(it->first);
+                if (j && j->status!=2){ ++it; continue; }
+                worker_send(sock, "DONE "+to_string(it->second)+" "+to_string(j? j->exit_status : 0));
+                it = remote_of.erase(it);
+            }
+            remove_completed_jobs();
+        }
+        if (pfd[0].revents & (POLLIN | POLLHUP)){
+            ssize_t n = recv(sock, buf, sizeof(buf)-1, 0);
+            if (n<=0){ quitting = true; continue; }   // coordinator went away
+            buf[n] = 0;
+            string msg(buf, (size_t)n);
+            if (msg=="QUIT"){ quitting = true; continue; }
+            if (msg.compare(0, 4, "RUN ")!=0) continue;
+            size_t sp = msg.find(' ', 4);
+            int rid = atoi(msg.c_str()+4);
+            string cmdline = sp==string::npos? "" : msg.substr(sp+1);
+            auto parsed = parse_pipeline(split_tokens(cmdline));
+            vector<pid_t> pids;
+            pid_t pgid = parsed.first.empty()? -1 : spawn_pipeline(parsed.first, true, pids);
+            if (pgid<0){ worker_send(sock, "DONE "+to_string(rid)+" "+to_string(127<<8)); continue; }
+            remote_of[add_job(pgid, cmdline, true, pids)] = rid;
+            worker_send(sock, "START "+to_string(rid)+" "+to_string(pgid));
+        }
+    }
+    _exit(0);
+}
+
+// Hand queued jobs to the least-loaded workers that have a free slot.
+static void workers_dispatch(){
+    while (!worker_queue.empty()){
+        Worker *best = nullptr;
+        for (auto &w: workers)
+            if (!w.stopping && w.inflight<worker_slots && (!best || w.inflight<best->inflight)) best = &w;
+        if (!best) return;
+        int jid = worker_queue.front(); worker_queue.pop_front();
+        Job *j = find_job_by_id(jid);
+        if (!j) continue;
+        if (!worker_send(best->sock, "RUN "+to_string(jid)+" "+j->cmdline)){ worker_queue.push_front(jid); best->stopping = true; continue; }
+        j->worker = (int)(best-&workers[0]);
+        best->inflight++;
+    }
+}
+
+// Drain status messages from every worker without blocking.
+void workers_poll(){
+    char buf[512];
+    for (size_t k=0;k<workers.size();++k){
+        Worker &w = workers[k];
+        if (w.sock<0) continue;
+        while (true){
+            ssize_t n = recv(w.sock, buf, sizeof(buf)-1, MSG_DONTWAIT);
+            if (n<0 && errno==EINTR) continue;
+            if (n<0) break;
+            if (n==0){   // worker exited: its unfinished jobs are lost
+                for (auto &j: jobs) if (j.worker==(int)k && j.status!=2){ j.exit_status = 255<<8; set_job_status(j, 2); }
+                close(w.sock); w.sock = -1; w.inflight = 0; w.stopping = true;
+                break;
+            }
+            buf[n] = 0;
+            int jid = 0; long v = 0;
+            if (sscanf(buf, "START %d %ld", &jid, &v)==2){ Job *j = find_job_by_id(jid); if (j) j->pgid = (pid_t)v; }
+            else if (sscanf(buf, "DONE %d %ld", &jid, &v)==2){
+                Job *j = find_job_by_id(jid);
+                if (j){ j->exit_status = (int)v; set_job_status(*j, 2); }
+                w.inflight--; w.done++;
+            }
+        }
+    }
+    workers_dispatch();
+}
+
+int workers_builtin(const vector<string> &argv, const string &line){
+    string sub = argv.size()>1? argv[1] : "status";
+    if (sub=="start" && argv.size()>2){
+        int n = max(1, atoi(argv[2].c_str()));
+        bool pin = false, cg = false;
+        for (size_t i=3;i<argv.size();++i){
+            if (argv[i]=="-a") pin = true;
+            else if (argv[i]=="-c") cg = true;
+            else if (argv[i]=="-s" && i+1<argv.size()) worker_slots = max(1, atoi(argv[++i].c_str()));
+        }
+        for (int k=0;k<n;++k){
+            int sv[2];
+            if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv)<0){ perror("workers: socketpair"); return 1; }
+            int index = (int)workers.size();
+            pid_t pid = fork();
+            if (pid<0){ perror("workers: fork"); close(sv[0]); close(sv[1]); return 1; }
+            if (pid==0){ close(sv[0]); worker_main(sv[1], index, pin, cg); }
+            close(sv[1]);
+            Worker w; w.pid = pid; w.sock = sv[0];
+            workers.push_back(w);
+        }
+        cout<<"workers: "<<workers.size()<<" running, "<<worker_slots<<" slots each\n";
+        return 0;
+    }
+    if (sub=="run"){
+        size_t dd = line.find(" -- ");
+        string cmdline = dd==string::npos? "" : trim(line.substr(dd+4));
+        if (cmdline.empty()){ cerr<<"usage: workers run -- cmd | cmd2 ...\n"; return 1; }
+        if (workers.empty()){ cerr<<"workers: no workers (workers start N)\n"; return 1; }
+        int jid = add_job(0, cmdline, true, {});
+        find_job_by_id(jid)->worker = -2;  // queued for the pool
+        worker_queue.push_back(jid);
+        workers_poll();
+        cout<<"["<<jid<<"] queued\n";
+        return 0;
+    }
+    if (sub=="stop"){
+        for (auto &w: workers) if (w.sock>=0){ worker_send(w.sock, "QUIT"); w.stopping = true; }
+        for (int jid: worker_queue){ Job *j = find_job_by_id(jid); if (j) set_job_status(*j, 2); }
+        worker_queue.clear();
+        return 0;
+    }
+    if (sub=="status"){
+        workers_poll();
+        for (size_t k=0;k<workers.size();++k)
+            cout<<"worker "<<k<<": pid="<<workers[k].pid<<" running="<<workers[k].inflight<<" done="<<workers[k].done
+                <<(workers[k].sock<0? " (exited)" : workers[k].stopping? " (stopping)" : "")<<"\n";
+        cout<<"queued: "<<worker_queue.size()<<"\n";
+        return 0;
+    }
+    cerr<<"usage: workers start N [-s slots] [-a] [-c] | run -- cmdline | status | stop\n";
+    return 1;
+}
+
+// ---- Detachable sessions ----
+// simpleshell -S name   attach to session `name`, starting it if needed
+// simpleshell -A name   attach to an existing session
+// simpleshell -l        list sessions
+// A session server owns a pty running an interactive shell (and so all of
+// its jobs) and listens on $XDG_RUNTIME_DIR/simpleshell/name.sock (or
+// /tmp/simpleshell-UID/). Clients relay the terminal over that socket;
+// Ctrl-] detaches. While nobody is attached the server keeps draining the
+// pty into a ring buffer of the most recent output, replayed on attach.
+// Client->server frames: 1 type byte ('d' data, 'w' struct winsize), 2
+// length bytes, payload. Server->client: raw pty output.
+
+static const char DETACH_KEY = 0x1d;  // Ctrl-]
+static const size_t SESSION_RING = 256*1024;
+
+static int session_connect(const string &path){
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_un a = {}; a.sun_family = AF_UNIX;
+    strncpy(a.sun_path, path.c_str(), sizeof(a.sun_path)-1);
+    if (fd>=0 && connect(fd, (struct sockaddr*)&a, sizeof(a))==0) return fd;
+    if (fd>=0) close(fd);
+    return -1;
+}
+
+// Server: never returns. ready is written once the socket accepts clients.
+[[noreturn]] static void session_server(const string &path, int ready){
+    setsid();
+    int master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (master<0 || grantpt(master)<0 || unlockpt(master)<0) _exit(1);
+    string slave = ptsname(master);
+    pid_t shell = fork();
+    if (shell==0){
+        setsid();
+        int s = open(slave.c_str(), O_RDWR);
+        if (s<0) _exit(1);
+        ioctl(s, TIOCSCTTY, 0);
+        dup2(s, 0); dup2(s, 1); dup2(s, 2);
+        if (s>2) close(s);
+        execl("/proc/self/exe", "simpleshell", (char*)nullptr);
+        _exit(127);
+    }
+    int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_un a = {}; a.sun_family = AF_UNIX;
+    strncpy(a.sun_path, path.c_str(), sizeof(a.sun_path)-1);
+    unlink(path.c_str());
+    if (shell<0 || lfd<0 || ::bind(lfd, (struct sockaddr*)&a, sizeof(a))<0 || listen(lfd, 4)<0) _exit(1);
+    write_all(ready, "1", 1); close(ready);
+    int devnull = open("/dev/null", O_RDWR);
+    dup2(devnull, 0); dup2(devnull, 1); dup2(devnull, 2);
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGHUP, SIG_IGN);
+
+    vector<char> ring(SESSION_RING);
+    size_t ring_start = 0, ring_len = 0;
+    int client = -1, pending = -1;   // pending: accepted, no frame yet (may be a -l probe)
+    string in;   // partial client frame
+    char buf[65536];
+    while (true){
+        struct pollfd pfd[4] = {{master, POLLIN, 0}, {lfd, POLLIN, 0}, {client, POLLIN, 0}, {pending, POLLIN, 0}};
+        if (poll(pfd, 4, -1)<0){ if (errno==EINTR) continue; break; }
+        if (pfd[0].revents & (POLLIN | POLLHUP)){
+            ssize_t n = read(master, buf, sizeof(buf));
+            if (n<=0) break;   // the shell exited
+            if (client>=0 && write_all(client, buf, (size_t)n)) continue;
+            if (client>=0){ close(client); client = -1; }
+            for (ssize_t k=0;k<n;++k){
+                ring[(ring_start+ring_len) % ring.size()] = buf[k];
+                if (ring_len<ring.size()) ring_len++; else ring_start = (ring_start+1) % ring.size();
+            }
+        }
+        if (pfd[1].revents & POLLIN){
+            int c = accept4(lfd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (c>=0){ if (pending>=0) close(pending); pending = c; }
+        }
+        if (pending>=0 && (pfd[3].revents & (POLLIN | POLLHUP))){
+            ssize_t n = read(pending, buf, sizeof(buf));
+            if (n<=0){ close(pending); pending = -1; continue; }
+            // first frame: this is a real client, and the newest one wins
+            if (client>=0) close(client);
+            client = pending; pending = -1;
+            size_t first = min(ring_len, ring.size()-ring_start);
+            write_all(client, ring.data()+ring_start, first);
+            write_all(client, ring.data(), ring_len-first);
+            ring_start = ring_len = 0;
+            in.assign(buf, (size_t)n);
+        } else if (client>=0 && (pfd[2].revents & (POLLIN | POLLHUP))){
+            ssize_t n = read(client, buf, sizeof(buf));
+            if (n<=0){ close(client); client = -1; continue; }
+            in.append(buf, (size_t)n);
+        } else continue;
+        while (in.size()>=3){
+            size_t len = (unsigned char)in[1] | ((unsigned char)in[2]<<8);
+            if (in.size()<3+len) break;
+            if (in[0]=='d') write_all(master, in.data()+3, len);
+            else if (in[0]=='w' && len==sizeof(struct winsize)){
+                struct winsize ws; memcpy(&ws, in.data()+3, len);
+                ioctl(master, TIOCSWINSZ, &ws);
+            }
+            in.erase(0, 3+len);
+        }
+    }
+    if (client>=0) close(client);
+    unlink(path.c_str());
+    waitpid(shell, nullptr, 0);
+    _exit(0);
+}
+
+static volatile sig_atomic_t winch = 0;
+static void session_winch(int){ winch = 1; }
+
+static bool session_frame(int fd, char type, const char *p, size_t n){
+    char hdr[3] = {type, (char)(n & 0xff), (char)(n>>8)};
+    return write_all(fd, hdr, 3) && write_all(fd, p, n);
+}
+
+static int session_attach(int fd){
+    struct termios saved, raw;
+    bool tty = tcgetattr(STDIN_FILENO, &saved)==0;
+    if (tty){ raw = saved; cfmakeraw(&raw); tcsetattr(STDIN_FILENO, TCSANOW, &raw); }
+    signal(SIGWINCH, session_winch);
+    winch = 1;
+    session_frame(fd, 'd', "", 0);   // announce ourselves even without a tty
+    char buf[4096];
+    const char *why = "[session ended]";
+    while (true){
+        if (winch){
+            winch = 0;
+            struct winsize ws;
+            if (ioctl(STDIN_FILENO, TIOCGWINSZ, &ws)==0) session_frame(fd, 'w', (const char*)&ws, sizeof(ws));
+        }
+        struct pollfd pfd[2] = {{STDIN_FILENO, POLLIN, 0}, {fd, POLLIN, 0}};
+        if (poll(pfd, 2, -1)<0){ if (errno==EINTR) continue; break; }
+        if (pfd[1].revents & (POLLIN | POLLHUP)){
+            ssize_t n = read(fd, buf, sizeof(buf));
+            if (n<=0) break;
+            write_all(STDOUT_FILENO, buf, (size_t)n);
+        }
+        if (pfd[0].revents & (POLLIN | POLLHUP)){
+            ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+            if (n<=0) break;
+            char *dk = (char*)memchr(buf, DETACH_KEY, (size_t)n);
+            if (dk){ session_frame(fd, 'd', buf, (size_t)(dk-buf)); why = "[detached]"; break; }
+            if (!session_frame(fd, 'd', buf, (size_t)n)) break;
+        }
+    }
+    if (tty) tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+    close(fd);
+    fprintf(stderr, "\r\n%s\r\n", why);
+    return 0;
+}
+
+int session_main(const string &opt, const string &name){
+    string dir = runtime_dir();
+    if (dir.empty()) return 1;
+    if (opt=="-l"){
+        DIR *d = opendir(dir.c_str());
+        while (struct dirent *e = d? readdir(d) : nullptr){
+            string n = e->d_name;
+            if (n.size()<6 || n.compare(n.size()-5, 5, ".sock")!=0) continue;
+            int fd = session_connect(dir+"/"+n);
+            if (fd<0){ unlink((dir+"/"+n).c_str()); continue; }   // stale
+            close(fd);
+            cout<<n.substr(0, n.size()-5)<<"\n";
+        }
+        if (d) closedir(d);
+        return 0;
+    }
+    if (name.empty() || name.find('/')!=string::npos){ cerr<<"simpleshell: bad session name\n"; return 2; }
+    string path = dir+"/"+name+".sock";
+    int fd = session_connect(path);
+    if (fd<0 && opt=="-S"){
+        int p[2];
+        if (pipe(p)<0){ perror("pipe"); return 1; }
+        pid_t pid = fork();
+        if (pid==0){ close(p[0]); if (fork()==0) session_server(path, p[1]); _exit(0); }
+        close(p[1]);
+        waitpid(pid, nullptr, 0);
+        char c;
+        if (read(p[0], &c, 1)==1) fd = session_connect(path);
+        close(p[0]);
+    }
+    if (fd<0){ cerr<<"simpleshell: no session "<<name<<"\n"; return 1; }
+    return session_attach(fd);
+}
+
+// ---- Metrics export ----
+// metrics file PATH [seconds] | metrics socket PATH | metrics off | metrics
+// Publishes shell and job metrics in the OpenMetrics text format: written to
+// PATH every few seconds (via a temp file and rename, so scrapers never see a
+// partial file) and/or served to anyone connecting to a Unix socket. Plain
+// `metrics` prints the current text. A background thread does the I/O; it
+// sees the job table through a snapshot the main loop refreshes (at the
+// prompt, on launch and on each reap in a foreground wait), while the
+// counters are atomics updated where jobs start and finish. Job states are
+// re-read from /proc at scrape time, so they are current even while the
+// main loop is busy. exit stops and joins the thread.
+
+struct MetricsJob { int id; string cmd; int status; vector<pid_t> pids; };
+
+static mutex metrics_mu;
+static vector<MetricsJob> metrics_jobs;   // guarded by metrics_mu
+static size_t metrics_queue = 0, metrics_workers = 0;
+static thread *metrics_thread = nullptr;   // joined by metrics_shutdown, only in the shell that started it
+static pid_t metrics_owner = 0;
+static atomic<bool> metrics_stop{false};
+static string metrics_file, metrics_sock;
+static int metrics_interval = 10;
+
+static void metrics_snapshot(){
+    lock_guard<mutex> g(metrics_mu);
+    metrics_jobs.clear();
+    for (auto &j: jobs) metrics_jobs.push_back({ j.id, j.cmdline, j.status, j.pids });
+    metrics_queue = worker_queue.size();
+    metrics_workers = workers.size();
+}
+
+void metrics_tick(){ if (metrics_thread) metrics_snapshot(); }
+
+static string om_escape(const string &s){
+    string o;
+    for (char c: s){
+        if (c=='\\' || c=='"') { o += '\\'; o += c; }
+        else if (c=='\n') o += "\\n";
+        else o += c;
+    }
+    return o;
+}
+
+// utime+stime ticks, rss pages, rchar, wchar of one process; false if gone.
+static bool proc_usage(pid_t pid, uint64_t &cpu, uint64_t &rss, uint64_t &rd, uint64_t &wr){
+    string s = "/proc/"+to_string(pid);
+    ifstream st(s+"/stat");
+    string line;
+    if (!getline(st, line)) return false;
+    size_t p = line.rfind(')');
+    if (p==string::npos) return false;
+    istringstream f(line.substr(p+2));
+    string tok;
+    uint64_t ut = 0, stime = 0, r = 0;
+    for (int field=3; f>>tok; ++field){   // field numbers as in proc(5)
+        if (field==14) ut = stoull(tok);
+        else if (field==15) stime = stoull(tok);
+        else if (field==24){ r = stoull(tok); break; }
+    }
+    cpu += ut+stime; rss += r;
+    ifstream io(s+"/io");   // not readable for processes we don't own
+    while (getline(io, line)){
+        if (line.rfind("rchar: ", 0)==0) rd += stoull(line.substr(7));
+        else if (line.rfind("wchar: ", 0)==0) wr += stoull(line.substr(7));
+    }
+    return true;
+}
+
+// Scheduler state letter from /proc/<pid>/stat, 0 if the process is gone.
+static char proc_state(pid_t pid){
+    ifstream st("/proc/"+to_string(pid)+"/stat");
+    string line;
+    if (!getline(st, line)) return 0;
+    size_t p = line.rfind(')');
+    return p!=string::npos && p+2<line.size()? line[p+2] : 0;
+}
+
+string metrics_text(){
+    vector<MetricsJob> js;
+    size_t queue, nworkers;
+    {
+        lock_guard<mutex> g(metrics_mu);
+        js = metrics_jobs; queue = metrics_queue; nworkers = metrics_workers;
+    }
+    ostringstream o;
+    auto head = [&](const char *name, const char *type, const char *help){
+        o<<"# TYPE "<<name<<" "<<type<<"\n# HELP "<<name<<" "<<help<<"\n";
+    };
+    head("simpleshell_jobs_launched", "counter", "Jobs started by the shell.");
+    o<<"simpleshell_jobs_launched_total "<<jobs_launched_total.load()<<"\n";
+    head("simpleshell_jobs_done", "counter", "Jobs that finished.");
+    o<<"simpleshell_jobs_done_total "<<jobs_done_total.load()<<"\n";
+    head("simpleshell_stages_spawned", "counter", "Pipeline stages forked.");
+    o<<"simpleshell_stages_spawned_total "<<stages_spawned_total.load()<<"\n";
+    int by_status[3] = {0, 0, 0};
+    for (auto &j: js){
+        if (j.status!=2 && !j.pids.empty()){   // refresh from the processes themselves
+            bool alive = false, stopped = false;
+            for (pid_t p: j.pids){
+                char c = proc_state(p);
+                if (c && c!='Z' && c!='X'){ alive = true; stopped |= c=='T' || c=='t'; }
+            }
+            j.status = !alive? 2 : stopped? 1 : 0;
+        }
+        by_status[j.status]++;
+    }
+    head("simpleshell_jobs", "gauge", "Jobs in the job table by state.");
+    const char *names[3] = { "running", "stopped", "done" };
+    for (int k=0;k<3;++k) o<<"simpleshell_jobs{state=\""<<names[k]<<"\"} "<<by_status[k]<<"\n";
+    head("simpleshell_worker_queue_depth", "gauge", "Jobs waiting for a worker slot.");
+    o<<"simpleshell_worker_queue_depth "<<queue<<"\n";
+    head("simpleshell_workers", "gauge", "Worker shells in the pool.");
+    o<<"simpleshell_workers "<<nworkers<<"\n";
+
+    if (stats_page){
+        // fork-to-exec histogram from the latency stats, in seconds
+        head("simpleshell_spawn_latency_seconds", "histogram", "Time from fork to exec of a stage.");
+        LatHist &h = stats_page->h[LAT_FORK_EXEC];
+        double k = stat_ns_per_tick()*1e-9;
+        const double les[] = { 1e-5, 1e-4, 1e-3, 1e-2, 1e-1, 1.0 };
+        uint64_t cum = 0; int i = 0;
+        for (double le: les){
+            for (; i<LAT_BUCKETS && lat_bucket_low(i+1)*k<=le; ++i) cum += h.b[i].load(memory_order_relaxed);
+            o<<"simpleshell_spawn_latency_seconds_bucket{le=\""<<le<<"\"} "<<cum<<"\n";
+        }
+        uint64_t n = h.count.load(memory_order_relaxed);
+        o<<"simpleshell_spawn_latency_seconds_bucket{le=\"+Inf\"} "<<n<<"\n";
+        o<<"simpleshell_spawn_latency_seconds_count "<<n<<"\n";
+        o<<"simpleshell_spawn_latency_seconds_sum "<<h.sum.load(memory_order_relaxed)*k<<"\n";
+    }
+
+    // per-job usage summed over the live stages; worker jobs have no local pids
+    static const long hz = sysconf(_SC_CLK_TCK), page = sysconf(_SC_PAGESIZE);
+    ostringstream cpu, rss, rd, wr;
+    for (auto &j: js){
+        uint64_t c = 0, r = 0, in = 0, out = 0;
+        bool any = false;
+        for (pid_t p: j.pids) any |= proc_usage(p, c, r, in, out);
+        if (!any) continue;
+        string l = "{job=\""+to_string(j.id)+"\",cmd=\""+om_escape(j.cmd)+"\"} ";
+        cpu<<"simpleshell_job_cpu_seconds_total"<<l<<(double)c/hz<<"\n";
+        rss<<"simpleshell_job_rss_bytes"<<l<<r*page<<"\n";
+        rd<<"simpleshell_job_read_bytes_total"<<l<<in<<"\n";
+        wr<<"simpleshell_job_written_bytes_total"<<l<<out<<"\n";
+    }
+    head("simpleshell_job_cpu_seconds", "counter", "User+system CPU of a job's live stages.");
+    o<<cpu.str();
+    head("simpleshell_job_rss_bytes", "gauge", "Resident set size of a job's live stages.");
+    o<<rss.str();
+    head("simpleshell_job_read_bytes", "counter", "Bytes read by a job's stages (pipes included).");
+    o<<rd.str();
+    head("simpleshell_job_written_bytes", "counter", "Bytes written by a job's stages (pipes included).");
+    o<<wr.str();
+    o<<"# EOF\n";
+    return o.str();
+}
+
+static void metrics_write_file(const string &path){
+    string text = metrics_text();
+    // a fresh name (O_EXCL) next to the target: the directory may be shared,
+    // and an existing file or symlink there must not be written through
+    string tmp = path+".tmp.XXXXXX";
+    int fd = mkostemp(&tmp[0], O_CLOEXEC);
+    if (fd<0) return;
+    bool ok = fchmod(fd, 0644)==0 && write_all(fd, text.data(), text.size());
+    close(fd);
+    if (!ok || rename(tmp.c_str(), path.c_str())<0) unlink(tmp.c_str());
+}
+
+static void metrics_loop(string file, string sock, int interval){
+    int lfd = -1;
+    if (!sock.empty()){
+        lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        struct sockaddr_un a; memset(&a, 0, sizeof(a)); a.sun_family = AF_UNIX;
+        strncpy(a.sun_path, sock.c_str(), sizeof(a.sun_path)-1);
+        unlink(sock.c_str());
+        if (lfd<0 || ::bind(lfd, (struct sockaddr*)&a, sizeof(a))<0 || listen(lfd, 8)<0){
+            perror("metrics: socket");
+            if (lfd>=0) close(lfd);
+            lfd = -1;
+        }
+    }
+    auto next = chrono::steady_clock::now();
+    while (!metrics_stop.load()){
+        auto now = chrono::steady_clock::now();
+        if (!file.empty() && now>=next){
+            metrics_write_file(file);
+            next = now + chrono::seconds(interval);
+        }
+        // wake at least every 200ms to notice metrics_stop
+        struct pollfd p = { lfd, POLLIN, 0 };
+        int r = poll(&p, lfd>=0? 1 : 0, 200);
+        if (r>0 && (p.revents & POLLIN)){
+            int c = accept4(lfd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (c>=0){ string text = metrics_text(); write_all(c, text.data(), text.size()); close(c); }
+        }
+    }
+    if (lfd>=0){ close(lfd); unlink(sock.c_str()); }
+}
+
+// Stop and join the export thread (no-op in forked children that inherited the pointer).
+void metrics_shutdown(){
+    if (!metrics_thread || getpid()!=metrics_owner) return;
+    metrics_stop = true; metrics_thread->join(); delete metrics_thread; metrics_thread = nullptr;
+}
+
+static void metrics_restart(){
+    metrics_shutdown();
+    metrics_stop = false;
+    if (metrics_file.empty() && metrics_sock.empty()) return;
+    metrics_snapshot();
+    metrics_thread = new thread(metrics_loop, metrics_file, metrics_sock, metrics_interval);
+    metrics_owner = getpid();
+}
+
+int metrics_builtin(const vector<string> &argv){
+    if (argv.size()==1){ metrics_snapshot(); cout<<metrics_text(); return 0; }
+    const string &a = argv[1];
+    if (a=="off"){ metrics_file.clear(); metrics_sock.clear(); }
+    else if (a=="file" && argv.size()>2){
+        metrics_file = argv[2];
+        if (argv.size()>3) metrics_interval = max(1, atoi(argv[3].c_str()));
+    }
+    else if (a=="socket" && argv.size()>2) metrics_sock = argv[2];
+    else { cerr<<"usage: metrics [file PATH [seconds] | socket PATH | off]\n"; return 1; }
+    metrics_restart();
+    return 0;
+}
+
+// ---- Pipeline profiler ----
+// jobs --profile %N [seconds]
+// Samples every stage of a running job (default 3s, every 20ms, Ctrl-C
+// stops early): scheduler state and wchan from /proc/<pid>, CPU and
+// rchar/wchar from proc_usage, and how full each inter-stage pipe is via
+// FIONREAD on a second read end opened through /proc/<pid>/fd/1. Each sample
+// classifies a stage as running, blocked reading (empty input pipe or
+// pipe_read), blocked writing (full output pipe or pipe_write) or waiting on
+// something else; the stage that is least often blocked on a pipe is the
+// one limiting the pipeline.
+
+static char proc_state(pid_t pid, string &wchan){
+    string s = "/proc/"+to_string(pid);
+    ifstream st(s+"/stat");
+    string line;
+    if (!getline(st, line)) return 0;
+    size_t p = line.rfind(')');
+    if (p==string::npos || p+2>=line.size()) return 0;
+    ifstream w(s+"/wchan");
+    if (!getline(w, wchan) || wchan=="0") wchan.clear();   // hidden without ptrace access
+    return line[p+2];
+}
+
+int job_profile(int id, double secs){
+    Job *jp = find_job_by_id(id);
+    if (!jp){ cerr<<"jobs: no such job\n"; return 1; }
+    if (jp->pids.empty() || jp->worker!=-1){ cerr<<"jobs: job has no local stages to profile\n"; return 1; }
+    vector<pid_t> pids = jp->pids;
+    string cmdline = jp->cmdline;
+    size_t n = pids.size();
+    auto stages = parse_pipeline(split_tokens(cmdline)).first;
+
+    // pipe i connects stage i to stage i+1
+    // (retried while sampling: a just-started stage may not have its fds set up yet)
+    vector<int> pipes(n>1? n-1 : 0, -1);
+    vector<int> cap(pipes.size(), 0);
+    auto open_pipe = [&](size_t i){
+        string link = "/proc/"+to_string(pids[i])+"/fd/1";
+        char buf[64];
+        ssize_t l = readlink(link.c_str(), buf, sizeof(buf)-1);
+        if (l<=0 || strncmp(buf, "pipe:", 5)!=0) return;
+        pipes[i] = open(link.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (pipes[i]>=0) cap[i] = fcntl(pipes[i], F_GETPIPE_SZ);
+    };
+
+    struct StageProf { uint64_t cpu0 = 0, cpu1 = 0, rd0 = 0, rd1 = 0, wr0 = 0, wr1 = 0; int run = 0, rd = 0, wr = 0, other = 0; bool gone = false; };
+    vector<StageProf> sp(n);
+    vector<double> fill(pipes.size(), 0);
+    for (size_t i=0;i<n;++i){ uint64_t r = 0; proc_usage(pids[i], sp[i].cpu0, r, sp[i].rd0, sp[i].wr0); }
+    auto t0 = chrono::steady_clock::now();
+    int samples = 0;
+    got_sigint = 0;
+    while (!got_sigint && chrono::duration<double>(chrono::steady_clock::now()-t0).count()<secs){
+        vector<int> level(pipes.size(), -1);
+        for (size_t i=0;i<pipes.size();++i){
+            int v;
+            if (pipes[i]<0) open_pipe(i);
+            if (pipes[i]>=0 && ioctl(pipes[i], FIONREAD, &v)==0){ level[i] = v; fill[i] += cap[i]? (double)v/cap[i] : 0; }
+        }
+        bool alive = false;
+        for (size_t i=0;i<n;++i){
+            string wchan;
+            char s = proc_state(pids[i], wchan);
+            if (!s || s=='Z'){ sp[i].gone = true; continue; }
+            alive = true;
+            bool in_empty = i>0 && level[i-1]==0;
+            bool out_full = i+1<n && level[i]>=0 && cap[i] && level[i]>=cap[i]-4096;
+            if (s=='R') sp[i].run++;
+            else if (wchan.find("pipe_read")!=string::npos || (wchan.empty() && in_empty)) sp[i].rd++;
+            else if (wchan.find("pipe_write")!=string::npos || (wchan.empty() && out_full)) sp[i].wr++;
+            else if (wchan.find("pipe")!=string::npos) (in_empty? sp[i].rd : sp[i].wr)++;
+            else sp[i].other++;
+        }
+        samples++;
+        if (!alive) break;
+        usleep(20000);
+    }
+    double wall = chrono::duration<double>(chrono::steady_clock::now()-t0).count();
+    for (size_t i=0;i<n;++i){ uint64_t r = 0; proc_usage(pids[i], sp[i].cpu1, r, sp[i].rd1, sp[i].wr1); }
+    for (int fd: pipes) if (fd>=0) close(fd);
+
+    static const long hz = sysconf(_SC_CLK_TCK);
+    char head[64];
+    snprintf(head, sizeof(head), ": %d samples over %.1fs\n", samples, wall);
+    cout<<"profile of ["<<id<<"] "<<cmdline<<head;
+    cout<<"stage  pid      cpu%   run  read-wait  write-wait  other  out-pipe  in-MB/s\n";
+    int limit = -1; double best = -1;
+    for (size_t i=0;i<n;++i){
+        StageProf &s = sp[i];
+        int tot = s.run+s.rd+s.wr+s.other;
+        auto pct = [&](int v){ return tot? 100.0*v/tot : 0.0; };
+        // a stage that exited has no end reading; count only what was seen
+        double cpu = s.cpu1>=s.cpu0? 100.0*(s.cpu1-s.cpu0)/hz/wall : 0;
+        double mbs = s.rd1>=s.rd0? (s.rd1-s.rd0)/wall/1e6 : 0;
+        char line[160];
+        string pipe = i+1<n && pipes[i]>=0 && samples? to_string((int)(100*fill[i]/samples))+"%" : "-";
+        snprintf(line, sizeof(line), "%-6zu %-8d %5.1f %5.0f%% %9.0f%% %10.0f%% %5.0f%% %9s %8.2f%s\n",
+            i, (int)pids[i], cpu, pct(s.run), pct(s.rd), pct(s.wr), pct(s.other), pipe.c_str(), mbs, s.gone? "  (exited)" : "");
+        cout<<line;
+        double busy = pct(s.run)+pct(s.other);
+        if (tot && busy>best){ best = busy; limit = (int)i; }
+    }
+    if (limit>=0){
+        StageProf &s = sp[limit];
+        string name = (size_t)limit<stages.size() && !stages[limit].argv.empty()? stages[limit].argv[0] : "?";
+        cout<<"limiting stage: "<<limit<<" ("<<name<<"), "
+            <<(s.run>=s.other? "CPU-bound" : "waiting outside the pipeline (disk, network, sleep)")<<"\n";
+    }
+    return 0;
+}
+
+// ---- ELF symbolizer ----
+// Maps an address inside a mapped file to a function name using the file's
+// .symtab (or .dynsym when stripped). Files are parsed once and cached;
+// only ELF64 is handled. Kernel addresses go through /proc/kallsyms when it
+// shows real addresses.
+
+struct ElfSym { uint64_t addr, size; string name; };
+struct ElfLoad { uint64_t offset, vaddr, filesz; };
+struct ElfFile { vector<ElfSym> syms; vector<ElfLoad> loads; };
+
+static map<string, ElfFile> elf_cache;
+
+static const ElfFile& elf_load(const string &path){
+    auto it = elf_cache.find(path);
+    if (it!=elf_cache.end()) return it->second;
+    ElfFile &ef = elf_cache[path];
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd<0) return ef;
+    struct stat st;
+    void *m = fstat(fd, &st)==0 && st.st_size>=(off_t)sizeof(Elf64_Ehdr)? mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (m==MAP_FAILED) return ef;
+    const char *base = (const char*)m;
+    size_t size = (size_t)st.st_size;
+    auto in = [&](uint64_t off, uint64_t n){ return off<=size && n<=size-off; };
+    const Elf64_Ehdr *eh = (const Elf64_Ehdr*)base;
+    if (memcmp(eh->e_ident, ELFMAG, SELFMAG)==0 && eh->e_ident[EI_CLASS]==ELFCLASS64
+        && in(eh->e_phoff, (uint64_t)eh->e_phnum*sizeof(Elf64_Phdr)) && in(eh->e_shoff, (uint64_t)eh->e_shnum*sizeof(Elf64_Shdr))){
+        const Elf64_Phdr *ph = (const Elf64_Phdr*)(base+eh->e_phoff);
+        for (int i=0;i<eh->e_phnum;++i)
+            if (ph[i].p_type==PT_LOAD) ef.loads.push_back({ ph[i].p_offset, ph[i].p_vaddr, ph[i].p_filesz });
+        const Elf64_Shdr *sh = (const Elf64_Shdr*)(base+eh->e_shoff);
+        for (int pass=0; pass<2 && ef.syms.empty(); ++pass){
+            uint32_t want = pass==0? SHT_SYMTAB : SHT_DYNSYM;
+            for (int i=0;i<eh->e_shnum;++i){
+                if (sh[i].sh_type!=want || sh[i].sh_link>=eh->e_shnum) continue;
+                const Elf64_Shdr &strs = sh[sh[i].sh_link];
+                if (!in(sh[i].sh_offset, sh[i].sh_size) || !in(strs.sh_offset, strs.sh_size)) continue;
+                const Elf64_Sym *sym = (const Elf64_Sym*)(base+sh[i].sh_offset);
+                size_t n = sh[i].sh_size/sizeof(Elf64_Sym);
+                for (size_t k=0;k<n;++k){
+                    if (ELF64_ST_TYPE(sym[k].st_info)!=STT_FUNC || !sym[k].st_value || sym[k].st_name>=strs.sh_size) continue;
+                    const char *name = base+strs.sh_offset+sym[k].st_name;
+                    ef.syms.push_back({ sym[k].st_value, sym[k].st_size, string(name, strnlen(name, strs.sh_size-sym[k].st_name)) });
+                }
+            }
+        }
+        sort(ef.syms.begin(), ef.syms.end(), [](const ElfSym &a, const ElfSym &b){ return a.addr<b.addr; });
+    }
+    munmap(m, size);
+    return ef;
+}
+
+static string demangle(const string &name){
+    int status = 0;
+    char *d = abi::__cxa_demangle(name.c_str(), nullptr, nullptr, &status);
+    if (!d) return name;
+    string s = d; free(d);
+    return s;
+}
+
+// Function containing file offset off of path, or "" if unknown.
+string elf_symbol(const string &path, uint64_t off){
+    const ElfFile &ef = elf_load(path);
+    uint64_t va = off;
+    for (auto &l: ef.loads) if (off>=l.offset && off<l.offset+l.filesz){ va = off-l.offset+l.vaddr; break; }
+    auto it = upper_bound(ef.syms.begin(), ef.syms.end(), va, [](uint64_t v, const ElfSym &s){ return v<s.addr; });
+    if (it==ef.syms.begin()) return "";
+    --it;
+    if (it->size && va>=it->addr+it->size) return "";
+    return demangle(it->name);
+}
+
+string kernel_symbol(uint64_t addr){
+    static vector<pair<uint64_t, string>> ksyms;
+    static bool loaded = false;
+    if (!loaded){
+        loaded = true;
+        ifstream f("/proc/kallsyms");
+        string line;
+        while (getline(f, line)){
+            istringstream s(line);
+            string a, type, name;
+            if (!(s>>a>>type>>name) || (type!="t" && type!="T")) continue;
+            uint64_t v = strtoull(a.c_str(), nullptr, 16);
+            if (v) ksyms.push_back({ v, name });   // all zero when kptr_restrict hides them
+        }
+        sort(ksyms.begin(), ksyms.end());
+    }
+    auto it = upper_bound(ksyms.begin(), ksyms.end(), make_pair(addr, string("\xff")));
+    if (it==ksyms.begin()) return "[kernel]";
+    return prev(it)->second;
+}
+
+// ---- Sampling profiler ----
+// profile [-F hz] [-o file] [--] pipeline
+// Runs the pipeline in the foreground with a sampling perf event on every
+// stage (cpu-cycles, or the cpu-clock software event when there is no PMU).
+// The stages are held at a gate pipe between fork and exec until their
+// events are open; the events start at exec (enable_on_exec). Samples carry
+// user and, where permitted, kernel call chains and are read from each
+// event's mmap ring; mmap records from the same ring say which file each
+// address belongs to. Output is folded stacks ("stage;outer;...;leaf N"),
+// the input format of flamegraph.pl, written to profile.folded by default.
+// Only the stage processes themselves are sampled, not their children.
+
+struct PerfMap { uint64_t start, len, pgoff; string path; };
+
+struct PerfStage {
+    int fd = -1;
+    char *ring = nullptr;      // metadata page followed by data pages
+    size_t data_size = 0;
+    string name;
+    map<uint64_t, PerfMap> maps;   // by start address
+};
+
+static const size_t PERF_DATA_PAGES = 64;   // power of two
+
+static int perf_open(pid_t pid, int hz, bool kernel, bool hw){
+    struct perf_event_attr a;
+    memset(&a, 0, sizeof(a));
+    a.size = sizeof(a);
+    a.type = hw? PERF_TYPE_HARDWARE : PERF_TYPE_SOFTWARE;
+    a.config = hw? (uint64_t)PERF_COUNT_HW_CPU_CYCLES : (uint64_t)PERF_COUNT_SW_CPU_CLOCK;
+    a.freq = 1; a.sample_freq = (uint64_t)hz;
+    a.sample_type = PERF_SAMPLE_TID | PERF_SAMPLE_CALLCHAIN;
+    a.disabled = 1; a.enable_on_exec = 1;
+    a.mmap = 1;
+    a.exclude_kernel = !kernel; a.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &a, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+static string perf_frame(PerfStage &s, uint64_t ip, bool kernel){
+    if (kernel) return kernel_symbol(ip)+"_[k]";
+    auto it = s.maps.upper_bound(ip);
+    if (it==s.maps.begin()) return "[unknown]";
+    const PerfMap &m = prev(it)->second;
+    if (ip>=m.start+m.len) return "[unknown]";
+    uint64_t off = ip-m.start+m.pgoff;
+    string sym = m.path.empty() || m.path[0]!='/'? "" : elf_symbol(m.path, off);
+    if (!sym.empty()) return sym;
+    char b[32]; snprintf(b, sizeof(b), "+0x%llx", (unsigned long long)off);
+    return "["+m.path.substr(m.path.rfind('/')+1)+b+"]";
+}
+
+// Consume the ring: note mmaps, fold samples into stacks.
+static void perf_drain(PerfStage &s, map<string, uint64_t> &stacks, uint64_t &samples, uint64_t &lost){
+    if (!s.ring) return;
+    auto *meta = (struct perf_event_mmap_page*)s.ring;
+    const char *data = s.ring + sysconf(_SC_PAGESIZE);
+    uint64_t head = __atomic_load_n(&meta->data_head, __ATOMIC_ACQUIRE);
+    uint64_t tail = meta->data_tail;
+    vector<char> rec;
+    auto copy = [&](void *dst, uint64_t pos, size_t n){   // records may wrap
+        for (size_t k=0;k<n;++k) ((char*)dst)[k] = data[(pos+k) & (s.data_size-1)];
+    };
+    while (tail<head){
+        struct perf_event_header h;
+        copy(&h, tail, sizeof(h));
+        if (h.size<sizeof(h)) break;
+        rec.resize(h.size);
+        copy(rec.data(), tail, h.size);
+        const char *p = rec.data()+sizeof(h);
+        if (h.type==PERF_RECORD_MMAP){
+            struct { uint32_t pid, tid; uint64_t addr, len, pgoff; } m;
+            memcpy(&m, p, sizeof(m));
+            s.maps[m.addr] = { m.addr, m.len, m.pgoff, string(p+sizeof(m)) };
+        } else if (h.type==PERF_RECORD_LOST){
+            uint64_t v[2]; memcpy(v, p, sizeof(v)); lost += v[1];
+        } else if (h.type==PERF_RECORD_SAMPLE){
+            uint64_t nr; memcpy(&nr, p+8, 8);
+            vector<uint64_t> ips(nr);
+            if (nr && 16+nr*8<=h.size-sizeof(h)) memcpy(ips.data(), p+16, nr*8);
+            vector<string> frames;
+            bool kernel = false;
+            for (uint64_t ip: ips){
+                if (ip>=(uint64_t)PERF_CONTEXT_MAX){ kernel = ip==(uint64_t)PERF_CONTEXT_KERNEL; continue; }
+                frames.push_back(perf_frame(s, ip, kernel));
+            }
+            string key = s.name;
+            for (auto f=frames.rbegin(); f!=frames.rend(); ++f) key += ";"+*f;
+            stacks[key]++;
+            samples++;
+        }
+        tail += h.size;
+    }
+    __atomic_store_n(&meta->data_tail, tail, __ATOMIC_RELEASE);
+}
+
+void profile_pipeline(vector<Command> &pipeline, bool background, const string &cmdline){
+    auto &a0 = pipeline[0].argv;
+    int hz = 99;
+    string out = "profile.folded";
+    size_t k = 1;
+    for (; k<a0.size(); ++k){
+        if (a0[k]=="-F" && k+1<a0.size()) hz = max(1, atoi(a0[++k].c_str()));
+        else if (a0[k]=="-o" && k+1<a0.size()) out = a0[++k];
+        else if (a0[k]=="--"){ ++k; break; }
+        else break;
+    }
+    a0.erase(a0.begin(), a0.begin()+k);
+    if (a0.empty()){ cerr<<"usage: profile [-F hz] [-o file] [--] command [| command]...\n"; return; }
+    if (background) cerr<<"profile: runs in the foreground\n";
+
+    sigset_t old;
+    block_sigchld(&old);
+    int gate[2];
+    if (pipe2(gate, O_CLOEXEC)<0){ perror("profile: pipe"); sigprocmask(SIG_SETMASK, &old, nullptr); return; }
+    spawn_gate[0] = gate[0]; spawn_gate[1] = gate[1];
+    vector<pid_t> pids;
+    pid_t pgid = spawn_pipeline(pipeline, false, pids);
+    spawn_gate[0] = spawn_gate[1] = -1;
+    close(gate[0]);
+    if (pgid<0){ close(gate[1]); sigprocmask(SIG_SETMASK, &old, nullptr); return; }
+
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    vector<PerfStage> st(pids.size());
+    const char *event = nullptr;
+    for (size_t i=0;i<pids.size();++i){
+        st[i].name = pipeline[i].argv.empty()? "?" : pipeline[i].argv[0].substr(pipeline[i].argv[0].rfind('/')+1);
+        if (pipeline.size()>1) st[i].name = to_string(i)+":"+st[i].name;
+        // cycles with kernel stacks, then fall back to what this machine allows
+        const pair<bool,bool> tries[] = { {true, true}, {false, true}, {true, false}, {false, false} };
+        for (auto &t: tries){
+            st[i].fd = perf_open(pids[i], hz, t.second, t.first);
+            if (st[i].fd>=0){ event = t.first? "cycles" : "cpu-clock"; break; }
+        }
+        if (st[i].fd<0){ perror("profile: perf_event_open"); continue; }
+        void *m = mmap(nullptr, (1+PERF_DATA_PAGES)*page, PROT_READ | PROT_WRITE, MAP_SHARED, st[i].fd, 0);
+        if (m==MAP_FAILED){ perror("profile: mmap"); close(st[i].fd); st[i].fd = -1; continue; }
+        st[i].ring = (char*)m; st[i].data_size = PERF_DATA_PAGES*page;
+    }
+    close(gate[1]);   // stages go on to exec
+
+    int jid = add_job(pgid, cmdline, false, pids);
+    tty_handoff(pgid);
+    map<string, uint64_t> stacks;
+    uint64_t samples = 0, lost = 0;
+    vector<struct pollfd> pfds;
+    for (auto &s: st) if (s.fd>=0) pfds.push_back({ s.fd, POLLIN, 0 });
+    while (true){
+        poll(pfds.data(), pfds.size(), 100);
+        for (auto &s: st) perf_drain(s, stacks, samples, lost);
+        int status;
+        pid_t w;
+        while ((w = waitpid(-pgid, &status, WNOHANG | WUNTRACED))>0) job_update(w, status);
+        Job *j = find_job_by_id(jid);
+        if (w<0 && errno==ECHILD && j) set_job_status(*j, 2);
+        if (!j || j->status!=0) break;
+    }
+    for (auto &s: st){
+        perf_drain(s, stacks, samples, lost);
+        if (s.ring) munmap(s.ring, (1+PERF_DATA_PAGES)*page);
+        if (s.fd>=0) close(s.fd);
+    }
+    tty_handoff(shell_pgid);
+    Job *j = find_job_by_id(jid);
+    if (j && j->status==1) cerr<<"\n["<<jid<<"] Stopped\t"<<cmdline<<"\n";
+    else remove_completed_jobs();
+    sigprocmask(SIG_SETMASK, &old, nullptr);
+
+    ofstream f(out);
+    for (auto &e: stacks) f<<e.first<<" "<<e.second<<"\n";
+    f.close();
+    cerr<<"profile: "<<samples<<" samples ("<<(event? event : "no events")<<" @ "<<hz<<" Hz";
+    if (lost) cerr<<", "<<lost<<" lost";
+    cerr<<") written to "<<out<<"\n";
+}
+
+// ---- Self profiler ----
+// shellprof start [-F hz] | shellprof stop [-o file] | shellprof
+// Samples the shell's own main thread: a CLOCK_THREAD_CPUTIME_ID timer
+// delivers SIGPROF to it every 1/hz of CPU time, and the handler stores a
+// backtrace() (unwind-table based, so no frame pointers needed) into a
+// preallocated buffer. stop symbolizes the return addresses against
+// /proc/self/maps with the ELF symbolizer and writes folded stacks
+// (default shellprof.folded), printing the hottest functions.
+// backtrace() is not async-signal-safe: the warm-up at start keeps the
+// unwinder from loading libgcc_s in the handler, but a sample that lands
+// while the main thread is itself unwinding (an exception in flight, or
+// dl_iterate_phdr in dlopen) can deadlock on the unwinder's lock. This is
+// a diagnostic tool; leave it off in normal use.
+
+static const int SP_DEPTH = 48;
+static const uint32_t SP_CAP = 1<<16;
+
+struct SelfProf {
+    timer_t timer;
+    bool on = false;
+    int hz = 997;
+    atomic<uint32_t> n{0};
+    vector<array<void*, SP_DEPTH>> frames;
+    vector<uint8_t> depth;
+};
+
+static SelfProf selfprof;
+
+static void sigprof_handler(int){
+    int saved_errno = errno;
+    uint32_t i = selfprof.n.fetch_add(1, memory_order_relaxed);
+    if (i<SP_CAP) selfprof.depth[i] = (uint8_t)backtrace(selfprof.frames[i].data(), SP_DEPTH);
+    errno = saved_errno;
+}
+
+int shellprof_builtin(const vector<string> &argv){
+    string sub = argv.size()>1? argv[1] : "";
+    if (sub=="start"){
+        if (selfprof.on){ cerr<<"shellprof: already running\n"; return 1; }
+        for (size_t k=2;k+1<argv.size();++k) if (argv[k]=="-F") selfprof.hz = max(1, atoi(argv[k+1].c_str()));
+        selfprof.frames.assign(SP_CAP, {});
+        selfprof.depth.assign(SP_CAP, 0);
+        selfprof.n = 0;
+        void *warm[1];
+        backtrace(warm, 1);   // loads libgcc_s now rather than inside the handler
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = sigprof_handler;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = SA_RESTART;
+        sigaction(SIGPROF, &sa, nullptr);
+        struct sigevent sev;
+        memset(&sev, 0, sizeof(sev));
+        sev.sigev_notify = SIGEV_THREAD_ID;
+        sev.sigev_signo = SIGPROF;
+        sev._sigev_un._tid = (pid_t)syscall(SYS_gettid);
+        if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &selfprof.timer)<0){ perror("shellprof: timer_create"); return 1; }
+        long ns = 1000000000L/selfprof.hz;
+        struct itimerspec it = { { ns/1000000000L, ns%1000000000L }, { ns/1000000000L, ns%1000000000L } };
+        timer_settime(selfprof.timer, 0, &it, nullptr);
+        selfprof.on = true;
+        return 0;
+    }
+    if (sub=="stop"){
+        if (!selfprof.on){ cerr<<"shellprof: not running\n"; return 1; }
+        timer_delete(selfprof.timer);
+        signal(SIGPROF, SIG_DFL);
+        selfprof.on = false;
+        string out = "shellprof.folded";
+        for (size_t k=2;k+1<argv.size();++k) if (argv[k]=="-o") out = argv[k+1];
+
+        struct Region { uint64_t start, end, off; string path; };
+        vector<Region> maps;
+        ifstream mf("/proc/self/maps");
+        string line;
+        while (getline(mf, line)){
+            unsigned long long a, b, off;
+            char perms[8], path[PATH_MAX] = "";
+            if (sscanf(line.c_str(), "%llx-%llx %7s %llx %*s %*s %4095s", &a, &b, perms, &off, path)<4 || perms[2]!='x') continue;
+            maps.push_back({ a, b, off, path });
+        }
+        map<uintptr_t, string> names;   // address -> frame name
+        auto name = [&](uintptr_t pc)->const string& {
+            auto it = names.find(pc);
+            if (it!=names.end()) return it->second;
+            string s = "[unknown]";
+            for (auto &r: maps){
+                if (pc<r.start || pc>=r.end) continue;
+                string sym = r.path.empty() || r.path[0]!='/'? "" : elf_symbol(r.path, pc-r.start+r.off);
+                s = !sym.empty()? sym : "["+r.path.substr(r.path.rfind('/')+1)+"]";
+                break;
+            }
+            return names[pc] = s;
+        };
+        uint32_t n = min(selfprof.n.load(), SP_CAP);
+        map<string, uint64_t> stacks, self;
+        for (uint32_t i=0;i<n;++i){
+            // frame 0 is the handler, 1 the signal trampoline, 2 the interrupted pc
+            string key = "simpleshell";
+            for (int d=selfprof.depth[i]-1; d>=2; --d){
+                uintptr_t pc = (uintptr_t)selfprof.frames[i][d];
+                key += ";"+name(d>2? pc-1 : pc);   // return addresses point past the call
+            }
+            stacks[key]++;
+            if (selfprof.depth[i]>2) self[name((uintptr_t)selfprof.frames[i][2])]++;
+        }
+        ofstream f(out);
+        for (auto &e: stacks) f<<e.first<<" "<<e.second<<"\n";
+        f.close();
+        cout<<"shellprof: "<<n<<" samples at "<<selfprof.hz<<" Hz of shell CPU written to "<<out<<"\n";
+        vector<pair<uint64_t, string>> top;
+        for (auto &e: self) top.push_back({ e.second, e.first });
+        sort(top.rbegin(), top.rend());
+        for (size_t k=0;k<top.size() && k<10;++k){
+            char b[16]; snprintf(b, sizeof(b), "%5.1f%%  ", 100.0*top[k].first/max(1u, n));
+            cout<<b<<top[k].second<<"\n";
+        }
+        selfprof.frames.clear(); selfprof.frames.shrink_to_fit();
+        selfprof.depth.clear(); selfprof.depth.shrink_to_fit();
+        return 0;
+    }
+    if (sub.empty()){ cout<<"shellprof: "<<(selfprof.on? "running, "+to_string(min(selfprof.n.load(), SP_CAP))+" samples" : "stopped")<<"\n"; return 0; }
+    cerr<<"usage: shellprof start [-F hz] | stop [-o file]\n";
+    return 1;
+}
+
+// ---- Benchmark ----
+// bench [-w warmups] [-n runs] [-p prepare] [--] pipeline
+// Runs the pipeline repeatedly through spawn_pipeline, in the foreground
+// and without a job-table entry, reaping the stages with wait4 to collect
+// user/system time and peak RSS. Output goes to /dev/null unless the
+// pipeline redirects it. The prepare command line (e.g. one that
+// drops caches) runs untimed before every run. Reports mean +- stddev,
+// range, percentiles and IQR outliers. Ctrl-C stops after the current run.
+
+struct BenchRun { double wall, user, sys; long rss_kb; int status; };
+
+static bool bench_once(vector<Command> pipeline, BenchRun &r){
+    sigset_t old;
+    block_sigchld(&old);
+    vector<pid_t> pids;
+    auto t0 = chrono::steady_clock::now();
+    pid_t pgid = spawn_pipeline(pipeline, false, pids);
+    if (pgid<0){ sigprocmask(SIG_SETMASK, &old, nullptr); return false; }
+    tty_handoff(pgid);
+    r = { 0, 0, 0, 0, 0 };
+    size_t left = pids.size();
+    while (left){
+        int status;
+        struct rusage ru;
+        pid_t w = wait4(-pgid, &status, WUNTRACED, &ru);
+        if (w<0){ if (errno==EINTR) continue; break; }
+        if (WIFSTOPPED(status)){ kill(-pgid, SIGKILL); kill(-pgid, SIGCONT); continue; }   // no job to stop into
+        r.user += ru.ru_utime.tv_sec + ru.ru_utime.tv_usec/1e6;
+        r.sys += ru.ru_stime.tv_sec + ru.ru_stime.tv_usec/1e6;
+        r.rss_kb = max(r.rss_kb, ru.ru_maxrss);
+        if (w==pids.back()) r.status = status;
+        left--;
+    }
+    r.wall = chrono::duration<double>(chrono::steady_clock::now()-t0).count();
+    tty_handoff(shell_pgid);
+    sigprocmask(SIG_SETMASK, &old, nullptr);
+    return true;
+}
+
+// The pipeline as it will run, for the report header.
+static string pipeline_text(const vector<Command> &pipeline){
+    string s;
+    for (size_t i=0;i<pipeline.size();++i){
+        const Command &c = pipeline[i];
+        if (i) s += " | ";
+        for (size_t k=0;k<c.argv.size();++k){
+            if (k) s += ' ';
+            bool quote = c.argv[k].empty() || c.argv[k].find_first_of(" \t|<>&")!=string::npos;
+            s += quote? "\""+c.argv[k]+"\"" : c.argv[k];
+        }
+        if (!c.infile.empty()) s += " < "+c.infile;
+        if (!c.outfile.empty()) s += (c.append? " >> " : " > ")+c.outfile;
+    }
+    return s;
+}
+
+int bench_pipeline(vector<Command> &pipeline, bool bg){
+    if (bg){ cerr<<"bench: cannot run in the background (drop the trailing &)\n"; return 1; }
+    auto &a0 = pipeline[0].argv;
+    int warm = 0, runs = 10;
+    string prep;
+    size_t k = 1;
+    for (; k<a0.size(); ++k){
+        if (a0[k]=="-w" && k+1<a0.size()) warm = max(0, atoi(a0[++k].c_str()));
+        else if (a0[k]=="-n" && k+1<a0.size()) runs = max(1, atoi(a0[++k].c_str()));
+        else if (a0[k]=="-p" && k+1<a0.size()) prep = a0[++k];
+        else if (a0[k]=="--"){ ++k; break; }
+        else break;
+    }
+    a0.erase(a0.begin(), a0.begin()+k);
+    if (a0.empty()){ cerr<<"usage: bench [-w warmups] [-n runs] [-p prepare] [--] command [| command]...\n"; return 1; }
+    auto prepared = parse_pipeline(split_tokens(prep)).first;
+    string shown = pipeline_text(pipeline);
+    if (pipeline.back().outfile.empty()) pipeline.back().outfile = "/dev/null";   // keep output out of the timing
+
+    vector<BenchRun> res;
+    int failed = 0;
+    got_sigint = 0;
+    for (int i=0;i<warm+runs && !got_sigint;++i){
+        if (!prepared.empty()){ BenchRun pr; bench_once(prepared, pr); }
+        BenchRun r;
+        if (!bench_once(pipeline, r)) return 1;
+        if (i<warm) continue;
+        if (!WIFEXITED(r.status) || WEXITSTATUS(r.status)!=0) failed++;
+        res.push_back(r);
+    }
+    if (res.empty()) return 1;
+
+    size_t n = res.size();
+    vector<double> w;
+    double sum = 0, user = 0, sys = 0, rss = 0;
+    for (auto &r: res){ w.push_back(r.wall); sum += r.wall; user += r.user; sys += r.sys; rss += r.rss_kb; }
+    double mean = sum/n, var = 0;
+    for (double x: w) var += (x-mean)*(x-mean);
+    double sd = n>1? sqrt(var/(n-1)) : 0;
+    sort(w.begin(), w.end());
+    auto pct = [&](double q){ return w[min(n-1, (size_t)(q*(n-1)+0.5))]; };
+    double q1 = pct(0.25), q3 = pct(0.75), iqr = q3-q1;
+    int outliers = 0;
+    for (double x: w) if (x<q1-1.5*iqr || x>q3+1.5*iqr) outliers++;
+
+    cout<<"Benchmark: "<<shown<<"\n";
+    cout<<"  Time (mean +- sd):   "<<fmt_ns(mean*1e9)<<" +- "<<fmt_ns(sd*1e9)
+        <<"    [User: "<<fmt_ns(user/n*1e9)<<", System: "<<fmt_ns(sys/n*1e9)<<"]\n";
+    cout<<"  Range (min ... max): "<<fmt_ns(w.front()*1e9)<<" ... "<<fmt_ns(w.back()*1e9)<<"    "<<n<<" runs\n";
+    char mb[32];
+    snprintf(mb, sizeof(mb), "%.1f", rss/n/1024);
+    cout<<"  p50 "<<fmt_ns(pct(0.5)*1e9)<<"  p90 "<<fmt_ns(pct(0.9)*1e9)<<"  p99 "<<fmt_ns(pct(0.99)*1e9)
+        <<"    max RSS "<<mb<<" MB (mean)\n";
+    if (outliers) cout<<"  Warning: "<<outliers<<" outlier(s) beyond 1.5 IQR; consider -w warmups or a quieter system.\n";
+    if (failed) cout<<"  Warning: "<<failed<<" run(s) exited with non-zero status.\n";
+    return failed? 1 : 0;
+}
+
+// ---- Spawn scaling benchmark ----
+// simpleshell --bench-spawn [max_mb] [runs]
+// Grows a ballast of touched heap blocks (standing in for a long-lived
+// shell's history and job state) from 1 MB up to max_mb (default 1024) in
+// 4x steps and at each size times `/bin/true` launched the way the shell
+// does it (spawn_pipeline: fork, then exec) and, for comparison, via
+// posix_spawn, which clones without copying page tables. Prints CSV:
+// rss_mb,backend,runs,mean_us,p50_us,p99_us.
+// The verdict goes to stderr and the exit status: 1 if fork's p50 grows
+// faster than linearly with RSS (log-log slope above SPAWN_SLOPE_MAX from
+// the smallest to the largest heap), or if at the smallest heap it is more
+// than SPAWN_BASE_MAX times posix_spawn's (extra work on the launch path).
+
+static double spawn_once(bool use_fork){
+    static vector<Command> pipeline = parse_pipeline(split_tokens("/bin/true")).first;
+    auto t0 = chrono::steady_clock::now();
+    pid_t pid = -1;
+    if (use_fork){
+        vector<pid_t> pids;
+        spawn_pipeline(pipeline, true, pids);
+        if (!pids.empty()) pid = pids[0];
+    } else {
+        char *argv[] = { (char*)"/bin/true", nullptr };
+        if (posix_spawn(&pid, "/bin/true", nullptr, nullptr, argv, environ)!=0) pid = -1;
+    }
+    if (pid>0) waitpid(pid, nullptr, 0);
+    return chrono::duration<double, micro>(chrono::steady_clock::now()-t0).count();
+}
+
+static const double SPAWN_SLOPE_MAX = 1.1, SPAWN_BASE_MAX = 3.0;
+
+int bench_spawn_main(int max_mb, int runs){
+    vector<unique_ptr<char[]>> ballast;
+    vector<double> sizes, fork_p50, spawn_p50;
+    const size_t block = 64*1024;   // below the mmap threshold, so it is ordinary heap
+    cout<<"rss_mb,backend,runs,mean_us,p50_us,p99_us\n";
+    for (int mb=1; mb<=max_mb; mb*=4){
+        while (ballast.size()*block < (size_t)mb<<20){
+            ballast.emplace_back(new char[block]);
+            memset(ballast.back().get(), 1, block);
+        }
+        long pages = 0, resident = 0;
+        ifstream("/proc/self/statm")>>pages>>resident;
+        double rss_mb = resident*(double)sysconf(_SC_PAGESIZE)/(1<<20);
+        sizes.push_back(rss_mb);
+        for (int use_fork=1; use_fork>=0; --use_fork){
+            vector<double> t;
+            for (int i=0;i<runs;++i) t.push_back(spawn_once(use_fork));
+            sort(t.begin(), t.end());
+            double sum = 0; for (double x: t) sum += x;
+            char line[128];
+            snprintf(line, sizeof(line), "%.1f,%s,%d,%.1f,%.1f,%.1f\n", rss_mb, use_fork? "fork" : "posix_spawn", runs,
+                sum/runs, t[t.size()/2], t[min(t.size()-1, (size_t)(0.99*t.size()))]);
+            cout<<line<<flush;
+            (use_fork? fork_p50 : spawn_p50).push_back(t[t.size()/2]);
+        }
+    }
+    double base = fork_p50[0]/max(spawn_p50[0], 1e-3);
+    double slope = sizes.size()>1? log(fork_p50.back()/fork_p50[0])/log(sizes.back()/sizes[0]) : 0;
+    bool ok = base<=SPAWN_BASE_MAX && slope<=SPAWN_SLOPE_MAX;
+    char l[160];
+    snprintf(l, sizeof(l), "spawn scaling: fork/posix_spawn %.2fx at %.0f MB (max %.1f), fork p50 ~ rss^%.2f (max %.1f): %s\n",
+        base, sizes[0], SPAWN_BASE_MAX, slope, SPAWN_SLOPE_MAX, ok? "ok" : "FAILED");
+    cerr<<l;
+    return ok? 0 : 1;
+}
+
+// ---- Live upgrade ----
+// exec-upgrade [path]
+// Re-executes the shell binary (default: the path this shell was started
+// from, so a rebuilt binary is picked up) without disturbing running jobs:
+// jobs stay our children across execve. The job table, worker pool, shell
+// options, terminal modes, the journal, stats and flight recorder regions,
+// a --record recording, the coalescing relay's pipes, $? and script input
+// stdio had read ahead are written to a memfd whose fd is passed in
+// SIMPLESHELL_UPGRADE_FD; fds the state refers to are kept open across the
+// exec. Refused while shellprof runs (its samples are addresses in the old
+// image). The prompt's cwd/branch caches start empty and refill.
+
+static string shell_exe;   // resolved at startup, before the file can be replaced
+static string upgrade_input;   // script input the old image had buffered, read before stdin
+
+// Next input line, taking what the old image had buffered first.
+bool upgrade_getline(string &line){
+    if (upgrade_input.empty()) return (bool)getline(cin, line);
+    size_t nl = upgrade_input.find('\n');
+    if (nl!=string::npos){ line = upgrade_input.substr(0, nl); upgrade_input.erase(0, nl+1); return true; }
+    string rest;   // a partial line: the rest of it is still on stdin
+    bool ok = (bool)getline(cin, rest);
+    line = upgrade_input+rest;
+    upgrade_input.clear();
+    return ok || !line.empty();
+}
+
+// Map a region handed over by the old image in place of the fresh one.
+static void* adopt_region(int fd, void *cur, int &cur_fd, size_t size){
+    void *m = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (m==MAP_FAILED){ close(fd); return cur; }
+    if (cur) munmap(cur, size);
+    if (cur_fd>=0) close(cur_fd);
+    cur_fd = fd;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return m;
+}
+
+static void keep_fd(int fd){ if (fd>=0) fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) & ~FD_CLOEXEC); }
+
+static string hex_bytes(const void *p, size_t n){
+    static const char *d = "0123456789abcdef";
+    string s;
+    for (size_t k=0;k<n;++k){ unsigned char c = ((const unsigned char*)p)[k]; s += d[c>>4]; s += d[c&15]; }
+    return s;
+}
+
+static void unhex_bytes(const string &s, void *p, size_t n){
+    for (size_t k=0;k<n && 2*k+1<s.size();++k) ((unsigned char*)p)[k] = (unsigned char)stoi(s.substr(2*k, 2), nullptr, 16);
+}
+
+int exec_upgrade(const vector<string> &argv){
+    string path = argv.size()>1? argv[1] : shell_exe;
+    if (path.empty() || access(path.c_str(), X_OK)!=0){ cerr<<"exec-upgrade: cannot execute "<<path<<"\n"; return 1; }
+    if (selfprof.on){ cerr<<"exec-upgrade: shellprof is running; stop it first\n"; return 1; }
+    sigset_t old;
+    block_sigchld(&old);   // stays blocked across execve; the new shell unblocks it
+    workers_poll();
+    journal_tick();
+
+    // one record per line: kind, tab-separated fields, free text last
+    ostringstream o;
+    o<<"simpleshell-upgrade 2\n";
+    o<<"next_job_id\t"<<next_job_id<<"\n";
+    struct termios cur;
+    if (tcgetattr(STDIN_FILENO, &cur)==0) o<<"tty\t"<<hex_bytes(&cur, sizeof(cur))<<"\n";
+    o<<"tmodes\t"<<hex_bytes(&shell_tmodes, sizeof(shell_tmodes))<<"\n";
+    for (auto &opt: shell_options) o<<"option\t"<<opt<<"\n";
+    if (journal){ keep_fd(journal_fd); o<<"journal\t"<<journal_fd<<"\n"; }
+    if (stats_page && stats_fd>=0){ keep_fd(stats_fd); o<<"stats\t"<<stats_fd<<"\n"; }
+    if (fr && fr_fd>=0){ keep_fd(fr_fd); o<<"flightrec\t"<<fr_fd<<"\n"; }
+    o<<"last_status\t"<<last_status<<"\n";
+    record_save(o);
+    auto relayed = coalesce_handoff();
+    for (auto &r: relayed){ keep_fd(r.first); o<<"coalesce\t"<<r.first<<"\t"<<r.second<<"\n"; }
+    o<<"worker_slots\t"<<worker_slots<<"\n";
+    for (auto &w: workers){
+        keep_fd(w.sock);
+        o<<"worker\t"<<w.pid<<"\t"<<w.sock<<"\t"<<w.inflight<<"\t"<<w.done<<"\t"<<w.stopping<<"\n";
+    }
+    for (int q: worker_queue) o<<"queued\t"<<q<<"\n";
+    if (!metrics_file.empty()) o<<"metrics_file\t"<<metrics_interval<<"\t"<<metrics_file<<"\n";
+    if (!metrics_sock.empty()) o<<"metrics_sock\t"<<metrics_sock<<"\n";
+    for (auto &j: jobs){
+        o<<"job\t"<<j.id<<"\t"<<j.pgid<<"\t"<<j.status<<"\t"<<j.is_background<<"\t"<<j.live<<"\t"<<j.exit_status<<"\t"<<j.worker<<"\t"<<j.coalesced<<"\t"<<j.pids.size();
+        for (size_t k=0;k<j.pids.size();++k){
+            int pfd = k<j.pidfds.size()? j.pidfds[k] : -2;   // -2: no pidfd tracking
+            keep_fd(pfd);
+            o<<"\t"<<j.pids[k]<<"\t"<<(k<j.starts.size()? j.starts[k] : 0)<<"\t"<<pfd;
+        }
+        o<<"\t"<<j.cmdline<<"\n";
+    }
+    // script input stdio has read ahead of us (glibc's buffer; a pipe cannot
+    // be rewound), plus whatever an earlier upgrade left unread
+    string input = upgrade_input;
+    size_t ahead = stdin->_IO_read_ptr && stdin->_IO_read_end>stdin->_IO_read_ptr? (size_t)(stdin->_IO_read_end-stdin->_IO_read_ptr) : 0;
+    input.append(stdin->_IO_read_ptr, ahead);
+    if (!input.empty()) o<<"input\t"<<hex_bytes(input.data(), input.size())<<"\n";
+    string state = o.str();
+    int mfd = memfd_create("simpleshell-upgrade", 0);
+    auto undo = [&](){
+        if (mfd>=0) close(mfd);
+        for (auto &r: relayed){ fcntl(r.first, F_SETFD, FD_CLOEXEC); coalesce_add(r.first, r.second); }
+        sigprocmask(SIG_SETMASK, &old, nullptr);
+    };
+    if (mfd<0 || !write_all(mfd, state.data(), state.size()) || lseek(mfd, 0, SEEK_SET)<0){
+        perror("exec-upgrade: memfd");
+        undo();
+        return 1;
+    }
+    setenv("SIMPLESHELL_UPGRADE_FD", to_string(mfd).c_str(), 1);
+    cout<<flush;
+    execl(path.c_str(), "simpleshell", (char*)nullptr);
+    perror("exec-upgrade: execve");
+    unsetenv("SIMPLESHELL_UPGRADE_FD");
+    undo();
+    return 1;
+}
+
+// In the new image: rebuild state written by exec_upgrade.
+void upgrade_restore(){
+    const char *env = getenv("SIMPLESHELL_UPGRADE_FD");
+    if (!env) return;
+    int mfd = atoi(env);
+    unsetenv("SIMPLESHELL_UPGRADE_FD");
+    string state;
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(mfd, buf, sizeof(buf)))>0) state.append(buf, (size_t)n);
+    close(mfd);
+    istringstream in(state);
+    string line;
+    if (!getline(in, line) || line!="simpleshell-upgrade 2"){ cerr<<"simple-shell: unrecognised upgrade state\n"; return; }
+    while (getline(in, line)){
+        istringstream f(line);
+        string kind;
+        getline(f, kind, '\t');
+        if (kind=="next_job_id") f>>next_job_id;
+        else if (kind=="tty"){ string h; f>>h; struct termios t; unhex_bytes(h, &t, sizeof(t)); tcsetattr(STDIN_FILENO, TCSADRAIN, &t); }
+        else if (kind=="tmodes"){ string h; f>>h; unhex_bytes(h, &shell_tmodes, sizeof(shell_tmodes)); }
+        else if (kind=="option"){ string v; getline(f, v); shell_options.insert(v); }
+        else if (kind=="journal"){
+            int fd; f>>fd;
+            void *m = mmap(nullptr, JOURNAL_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (m!=MAP_FAILED){ journal = (JournalHeader*)m; journal_fd = fd; fcntl(fd, F_SETFD, FD_CLOEXEC); }
+        }
+        else if (kind=="stats"){ int fd; f>>fd; stats_page = (StatsPage*)adopt_region(fd, stats_page, stats_fd, sizeof(StatsPage)); }
+        else if (kind=="flightrec"){ int fd; f>>fd; fr = (FlightRing*)adopt_region(fd, fr, fr_fd, sizeof(FlightRing)); }
+        else if (kind=="last_status") f>>last_status;
+        else if (kind=="record") record_restore(f);
+        else if (kind=="coalesce"){ int fd, jid; f>>fd>>jid; fcntl(fd, F_SETFD, FD_CLOEXEC); coalesce_add(fd, jid); }
+        else if (kind=="input"){ string h; f>>h; upgrade_input.resize(h.size()/2); unhex_bytes(h, &upgrade_input[0], upgrade_input.size()); }
+        else if (kind=="worker_slots") f>>worker_slots;
+        else if (kind=="worker"){
+            Worker w; int stopping;
+            f>>w.pid>>w.sock>>w.inflight>>w.done>>stopping;
+            w.stopping = stopping;
+            if (w.sock>=0) fcntl(w.sock, F_SETFD, FD_CLOEXEC);
+            workers.push_back(w);
+        }
+        else if (kind=="queued"){ int q; f>>q; worker_queue.push_back(q); }
+        else if (kind=="metrics_file"){ f>>metrics_interval; f.get(); getline(f, metrics_file); }
+        else if (kind=="metrics_sock") getline(f, metrics_sock);
+        else if (kind=="job"){
+            Job j; size_t np; int bg, co;
+            f>>j.id>>j.pgid>>j.status>>bg>>j.live>>j.exit_status>>j.worker>>co>>np;
+            j.is_background = bg; j.coalesced = co;
+            bool tracked = false;
+            for (size_t k=0;k<np;++k){
+                pid_t p; uint64_t st; int pfd;
+                f>>p>>st>>pfd;
+                j.pids.push_back(p); j.starts.push_back(st);
+                if (pfd!=-2){ tracked = true; j.pidfds.push_back(pfd); if (pfd>=0) fcntl(pfd, F_SETFD, FD_CLOEXEC); }
+            }
+            if (!tracked) j.pidfds.clear();
+            f.get();   // tab before the command line
+            getline(f, j.cmdline);
+            jobs.push_back(j);
+        }
+    }
+    metrics_restart();
+    cerr<<"simple-shell: upgraded, "<<jobs.size()<<" job(s) kept\n";
+}
+
+// ---- Prompt ----
+// The prompt is a template (SIMPLESHELL_PROMPT, default below) of {segment}s:
+//   {cwd} {dir} {user} {host} {jobs} {status} {duration} {branch}
+// cwd, user and host are cached (cwd is refreshed only by cd). {branch} is
+// read from .git/.hg on a worker thread: the prompt waits at most
+// PROMPT_DEADLINE_MS for it, otherwise shows the last known value. A late
+// answer is drawn in place only when no one can be typing at the prompt
+// (input is not an echoing canonical tty: the kernel keeps a half-typed
+// line to itself, so we could not tell); otherwise it shows up in the next
+// prompt. Each prompt goes out in a single write.
+
+static const char *PROMPT_DEFAULT = "simple-shell:{cwd}$ ";
+static const int PROMPT_DEADLINE_MS = 5;
+static const int PROMPT_REDRAW_MS = 250;    // give up on redrawing a prompt older than this
+static string cwd_cache, user_cache, host_cache;
+static double last_duration_ns = 0;         // wall time of the last line
+static mutex prompt_mu;
+static condition_variable &prompt_cv = *new condition_variable;   // leaked: exits that skip prompt_stop (forked children) leave the worker waiting on it
+static thread *vcs_thread = nullptr;        // joined by prompt_stop, in the shell that started it
+static pid_t vcs_owner = 0;
+static bool vcs_quit = false;               // guarded by prompt_mu
+static string vcs_want;                     // directory asked for
+static uint64_t vcs_req_gen = 0, vcs_done_gen = 0;
+static map<string,string> vcs_cache;        // directory -> branch ("" outside a repo)
+static bool prompt_waiting = false;         // main thread is blocked reading a line (redraws allowed)
+static string prompt_shown, prompt_dir, prompt_branch;   // prompt_shown has \x01 for {branch}
+static chrono::steady_clock::time_point prompt_at;
+
+// Input is being typed on a tty that echoes it: anything we write over the
+// prompt line could cover a half-typed command.
+bool prompt_input_live(){
+    struct termios t;
+    return isatty(STDIN_FILENO) && tcgetattr(STDIN_FILENO, &t)==0 && (t.c_lflag & ICANON) && (t.c_lflag & ECHO);
+}
+
+void cwd_refresh(){
+    char cwd[PATH_MAX];
+    cwd_cache = getcwd(cwd, sizeof(cwd))? cwd : "?";
+}
+
+static string first_line(const string &path){
+    ifstream in(path);
+    string s;
+    getline(in, s);
+    return trim(s);
+}
+
+// Branch of the git or mercurial checkout containing dir, "" if none.
+string vcs_branch(string dir){
+    while (!dir.empty()){
+        string base = dir=="/"? "" : dir;
+        struct stat st;
+        if (stat((base+"/.git").c_str(), &st)==0){
+            string gd = base+"/.git";
+            if (S_ISREG(st.st_mode)){   // worktree or submodule: "gitdir: PATH"
+                string l = first_line(gd);
+                if (l.compare(0, 8, "gitdir: ")!=0) return "";
+                gd = l.substr(8);
+                if (gd[0]!='/') gd = base+"/"+gd;
+            }
+            string head = first_line(gd+"/HEAD");
+            if (head.compare(0, 16, "ref: refs/heads/")==0) return head.substr(16);
+            if (head.compare(0, 5, "ref: ")==0) return head.substr(5);
+            return head.substr(0, 7);   // detached
+        }
+        if (stat((base+"/.hg").c_str(), &st)==0){
+            string b = first_line(base+"/.hg/branch");
+            return b.empty()? "default" : b;
+        }
+        if (dir=="/") break;
+        size_t p = dir.rfind('/');
+        dir = p==0||p==string::npos? "/" : dir.substr(0, p);
+    }
+    return "";
+}
+
+static string prompt_fill(const string &shown, const string &branch){
+    string s;
+    for (char c: shown){ if (c=='\x01') s += branch; else s += c; }
+    return s;
+}
+
+void vcs_worker(){
+    unique_lock<mutex> lk(prompt_mu);
+    while (true){
+        prompt_cv.wait(lk, []{ return vcs_req_gen!=vcs_done_gen || vcs_quit; });
+        if (vcs_quit) return;
+        uint64_t gen = vcs_req_gen;
+        string dir = vcs_want;
+        lk.unlock();
+        string b = vcs_branch(dir);
+        lk.lock();
+        vcs_cache[dir] = b;
+        vcs_done_gen = gen;
+        prompt_cv.notify_all();
+        // late answer: redraw the prompt in place if that cannot clobber input
+        if (prompt_waiting && prompt_dir==dir && b!=prompt_branch
+            && chrono::steady_clock::now()-prompt_at < chrono::milliseconds(PROMPT_REDRAW_MS)
+            && isatty(STDOUT_FILENO) && !prompt_input_live()){
+            prompt_branch = b;
+            string s = "\r\033[K"+prompt_fill(prompt_shown, b);
+            write_all(STDOUT_FILENO, s.data(), s.size());
+        }
+    }
+}
+
+// Stop and join the branch lookup thread before exit (not in forked
+// children that inherited the pointer). A lookup in progress finishes first.
+void prompt_stop(){
+    if (!vcs_thread || getpid()!=vcs_owner) return;
+    {
+        lock_guard<mutex> lk(prompt_mu);
+        vcs_quit = true;
+    }
+    prompt_cv.notify_all();
+    vcs_thread->join();
+    delete vcs_thread;
+    vcs_thread = nullptr;
+}
+
+// Expand every segment except {branch}, which becomes \x01.
+static string prompt_expand(const string &tpl, bool &want_branch){
+    string out;
+    for (size_t i=0; i<tpl.size(); ){
+        size_t e = tpl[i]=='{'? tpl.find('}', i) : string::npos;
+        if (e==string::npos){ out += tpl[i++]; continue; }
+        string seg = tpl.substr(i+1, e-i-1);
+        if (seg=="cwd") out += cwd_cache;
+        else if (seg=="dir"){ size_t p = cwd_cache.rfind('/'); out += p==string::npos||cwd_cache.size()==1? cwd_cache : cwd_cache.substr(p+1); }
+        else if (seg=="user") out += user_cache;
+        else if (seg=="host") out += host_cache;
+        else if (seg=="jobs"){ int n = 0; for (auto &j: jobs) if (j.status!=2) n++; out += to_string(n); }
+        else if (seg=="status") out += to_string(last_status);
+        else if (seg=="duration") out += fmt_ns(last_duration_ns);
+        else if (seg=="branch"){ out += '\x01'; want_branch = true; }
+        else { out += tpl[i++]; continue; }   // not a segment, keep literally
+        i = e+1;
+    }
+    return out;
+}
+
+void prompt_show(){
+    if (cwd_cache.empty()){
+        cwd_refresh();
+        const char *u = getenv("USER");
+        user_cache = u? u : to_string(getuid());
+        char h[256] = "";
+        gethostname(h, sizeof(h)-1);
+        host_cache = h;
+    }
+    const char *tpl = getenv("SIMPLESHELL_PROMPT");
+    bool want_branch = false;
+    string shown = prompt_expand(tpl? tpl : PROMPT_DEFAULT, want_branch);
+    string branch;
+    if (want_branch){
+        unique_lock<mutex> lk(prompt_mu);
+        if (!vcs_thread){ vcs_thread = new thread(vcs_worker); vcs_owner = getpid(); }
+        vcs_want = cwd_cache;
+        uint64_t gen = ++vcs_req_gen;
+        prompt_cv.notify_all();
+        prompt_cv.wait_for(lk, chrono::milliseconds(PROMPT_DEADLINE_MS), [gen]{ return vcs_done_gen>=gen; });
+        auto it = vcs_cache.find(cwd_cache);
+        if (it!=vcs_cache.end()) branch = it->second;
+    }
+    string s = prompt_fill(shown, branch);
+    cout.flush();
+    lock_guard<mutex> lk(prompt_mu);
+    write_all(STDOUT_FILENO, s.data(), s.size());
+    prompt_shown = shown; prompt_dir = cwd_cache; prompt_branch = branch;
+    prompt_at = chrono::steady_clock::now();
+    prompt_waiting = true;
+}
+
+// Called once a line has been read: no more redraws.
+void prompt_done(){
+    {
+        lock_guard<mutex> lk(prompt_mu);
+        prompt_waiting = false;
+    }
+    coalesce_kick();   // release output held while the line was typed
+}
+
+// ---- Output coalescing ----
+// With `set -o coalesce`, background jobs write stdout (last stage) and
+// stderr (every stage) into a pipe owned by the shell instead of the
+// terminal. A relay thread cuts what arrives into whole lines prefixed with
+// the job id and writes them out in one batch at most every
+// COALESCE_FLUSH_MS; when the batch is full it stops reading, so a flood
+// blocks the writers on their pipes rather than the terminal. While the
+// user may be typing at the prompt (prompt_input_live) the batch is held
+// and goes out as soon as the line is submitted, so a half-typed command's
+// echo is never overwritten; with non-interactive input it is written
+// above the prompt, which is redrawn. A held batch never stops the relay
+// reading (an idle prompt would otherwise stall the jobs): lines past
+// COALESCE_BATCH_MAX are dropped and counted, and the count is reported
+// when the batch goes out. A job brought back with fg passes
+// through unprefixed and unthrottled until it stops or ends. exit stops the
+// thread after reading for up to COALESCE_DRAIN_MS more and writing what it
+// holds; jobs still running then get EPIPE. exec-upgrade instead takes the
+// pipes back from the thread (coalesce_handoff) and passes them to the new
+// image, which relays them again.
+
+static const int COALESCE_FLUSH_MS = 50;
+static const size_t COALESCE_BATCH_MAX = 64<<10;
+static const size_t COALESCE_LINE_MAX = 4096;   // longer lines are split
+static const int COALESCE_DRAIN_MS = 200;       // at exit, wait this long for jobs' last output
+struct CoalesceSrc { int fd; int jid; string part; };
+static mutex coalesce_mu;
+static vector<CoalesceSrc> coalesce_new;   // handed over by the main thread
+static set<int> coalesce_fg;               // jobs in the foreground (guarded by coalesce_mu)
+static bool coalesce_quit = false;         // guarded by coalesce_mu
+static bool coalesce_handing = false;      // quit without closing the pipes (guarded by coalesce_mu)
+static vector<pair<int,int>> coalesce_handed;   // (fd, job id) left by the thread on handoff
+static int coalesce_wake[2] = { -1, -1 };
+static thread *coalesce_thread = nullptr;  // joined by coalesce_stop, in the shell that started it
+static pid_t coalesce_owner = 0;
+
+static void coalesce_line(string &batch, int jid, const char *p, size_t n){
+    batch += "["+to_string(jid)+"] ";
+    batch.append(p, n);
+    batch += '\n';
+}
+
+// Write the batch out, with a note of lines dropped while it was held;
+// false (and nothing written) while input is live at the prompt.
+static bool coalesce_flush(string &batch, bool force, size_t &dropped){
+    lock_guard<mutex> lk(prompt_mu);
+    if (prompt_waiting && !force && prompt_input_live()) return false;
+    if (dropped){ batch += "[coalesce] "+to_string(dropped)+" line(s) dropped while output was held at the prompt\n"; dropped = 0; }
+    if (prompt_waiting && isatty(STDOUT_FILENO)){
+        string s = "\r\033[K"+batch+prompt_fill(prompt_shown, prompt_branch);
+        write_all(STDOUT_FILENO, s.data(), s.size());
+    } else write_all(STDOUT_FILENO, batch.data(), batch.size());
+    batch.clear();
+    return true;
+}
+
+void coalesce_loop(){
+    vector<CoalesceSrc> srcs;
+    string batch;
+    auto last = chrono::steady_clock::now()-chrono::milliseconds(COALESCE_FLUSH_MS);
+    vector<char> buf(16384);
+    bool held = false, draining = false;
+    size_t dropped = 0;
+    chrono::steady_clock::time_point drain_until;
+    auto add_line = [&](int jid, const char *p, size_t n){
+        if (held && batch.size()>=COALESCE_BATCH_MAX){ dropped++; return; }
+        coalesce_line(batch, jid, p, n);
+    };
+    while (true){
+        set<int> fg;
+        bool quit, handing;
+        {
+            lock_guard<mutex> lk(coalesce_mu);
+            for (auto &s: coalesce_new) srcs.push_back(move(s));
+            coalesce_new.clear();
+            fg = coalesce_fg;
+            quit = coalesce_quit;
+            handing = coalesce_handing;
+        }
+        if (handing){   // write what we hold, leave the pipes open
+            for (auto &s: srcs){
+                if (!s.part.empty()) coalesce_line(batch, s.jid, s.part.data(), s.part.size());
+                coalesce_handed.push_back({ s.fd, s.jid });
+            }
+            if (!batch.empty()) coalesce_flush(batch, true, dropped);
+            return;
+        }
+        if (quit && !draining){ draining = true; drain_until = chrono::steady_clock::now()+chrono::milliseconds(COALESCE_DRAIN_MS); }
+        if (draining && (srcs.empty() || chrono::steady_clock::now()>=drain_until)){
+            for (auto &s: srcs){
+                if (!s.part.empty()) coalesce_line(batch, s.jid, s.part.data(), s.part.size());
+                close(s.fd);
+            }
+            if (!batch.empty()) coalesce_flush(batch, true, dropped);
+            return;
+        }
+        if (draining && batch.size()>=COALESCE_BATCH_MAX) coalesce_flush(batch, true, dropped);
+        bool full = !held && batch.size()>=COALESCE_BATCH_MAX;
+        vector<pollfd> pfds{ { coalesce_wake[0], POLLIN, 0 } };
+        if (!full) for (auto &s: srcs) pfds.push_back({ s.fd, POLLIN, 0 });
+        int timeout = draining? 10 : -1;
+        if (!batch.empty() && !held && !draining){
+            auto since = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now()-last).count();
+            timeout = (int)max<long long>(0, COALESCE_FLUSH_MS-since);
+        }
+        if (poll(pfds.data(), pfds.size(), timeout)<0 && errno!=EINTR) return;
+        if (pfds[0].revents){ char c[64]; while (read(coalesce_wake[0], c, sizeof(c))>0) {} held = false; }
+        for (size_t i=1;i<pfds.size();++i){
+            if (!pfds[i].revents) continue;
+            auto &s = srcs[i-1];
+            ssize_t k = read(s.fd, buf.data(), buf.size());
+            if (k<0 && errno==EINTR) continue;
+            if (k<=0){   // every writer gone: flush the unterminated tail
+                if (!s.part.empty()) add_line(s.jid, s.part.data(), s.part.size());
+                close(s.fd); s.fd = -1;
+                continue;
+            }
+            if (fg.count(s.jid)){   // foreground: straight through, after what came before it
+                if (!batch.empty()) coalesce_flush(batch, true, dropped);
+                s.part.append(buf.data(), (size_t)k);
+                write_all(STDOUT_FILENO, s.part.data(), s.part.size());
+                s.part.clear();
+                continue;
+            }
+            s.part.append(buf.data(), (size_t)k);
+            size_t st = 0, nl;
+            while ((nl = s.part.find('\n', st))!=string::npos){ add_line(s.jid, s.part.data()+st, nl-st); st = nl+1; }
+            s.part.erase(0, st);
+            while (s.part.size()>=COALESCE_LINE_MAX){ add_line(s.jid, s.part.data(), COALESCE_LINE_MAX); s.part.erase(0, COALESCE_LINE_MAX); }
+        }
+        srcs.erase(remove_if(srcs.begin(), srcs.end(), [](const CoalesceSrc &s){ return s.fd<0; }), srcs.end());
+        auto now = chrono::steady_clock::now();
+        if (!batch.empty() && !held && now-last>=chrono::milliseconds(COALESCE_FLUSH_MS)){
+            if (coalesce_flush(batch, false, dropped)) last = now;
+            else held = true;   // until prompt_done kicks us
+        }
+    }
+}
+
+// Wake the relay: new sources, a submitted line, fg changes or quit.
+void coalesce_kick(){
+    char c = 1;
+    if (coalesce_wake[1]>=0 && write(coalesce_wake[1], &c, 1)<0) {}
+}
+
+// Hand the read end of a job's output pipe to the relay thread.
+void coalesce_add(int fd, int jid){
+    if (!coalesce_thread){
+        if (pipe2(coalesce_wake, O_CLOEXEC|O_NONBLOCK)<0){ perror("coalesce: pipe"); close(fd); return; }
+        coalesce_thread = new thread(coalesce_loop);
+        coalesce_owner = getpid();
+    }
+    {
+        lock_guard<mutex> lk(coalesce_mu);
+        coalesce_new.push_back({ fd, jid, "" });
+    }
+    coalesce_kick();
+}
+
+void coalesce_foreground(int jid, bool on){
+    {
+        lock_guard<mutex> lk(coalesce_mu);
+        if (on) coalesce_fg.insert(jid); else coalesce_fg.erase(jid);
+    }
+    coalesce_kick();
+}
+
+// Stop the relay for exec-upgrade and return its pipes as (fd, job id);
+// coalesce_add starts it again with them.
+vector<pair<int,int>> coalesce_handoff(){
+    vector<pair<int,int>> fds;
+    if (!coalesce_thread || getpid()!=coalesce_owner) return fds;
+    {
+        lock_guard<mutex> lk(coalesce_mu);
+        coalesce_handing = true;
+    }
+    coalesce_kick();
+    coalesce_thread->join();
+    delete coalesce_thread;
+    coalesce_thread = nullptr;
+    coalesce_handing = false;
+    close(coalesce_wake[0]); close(coalesce_wake[1]);
+    coalesce_wake[0] = coalesce_wake[1] = -1;
+    fds.swap(coalesce_handed);
+    return fds;
+}
+
+// Flush and join the relay before exit (only in the shell that owns it,
+// not in forked children that inherited the pointer).
+void coalesce_stop(){
+    if (!coalesce_thread || getpid()!=coalesce_owner) return;
+    {
+        lock_guard<mutex> lk(coalesce_mu);
+        coalesce_quit = true;
+    }
+    coalesce_kick();
+    coalesce_thread->join();
+    delete coalesce_thread;
+    coalesce_thread = nullptr;
+}
+
+// ---- Line execution ----
+
+// Run one input line: tokenise, parse and dispatch to a prefix handler, an
+// in-shell builtin or launch_pipeline.
+void execute_line(string line){
+    line = trim(line);
+    if (line.empty()) return;
+    // tokenise
+    uint64_t t_parse = stat_ticks();
+    auto toks = split_tokens(line);
+    auto parsed = parse_pipeline(toks);
+    lat_record(LAT_PARSE, stat_ticks()-t_parse);
+    fr_record(FR_PARSE, (int32_t)parsed.first.size(), (int64_t)toks.size());
+    auto pipeline = parsed.first; bool bg = parsed.second;
+    if (pipeline.empty()) return;
+    // watch wraps the whole pipeline
+    if (!pipeline[0].argv.empty() && pipeline[0].argv[0]=="watch"){
+        last_status = watch_pipeline(pipeline, line, bg);
+        return;
+    }
+    // so does bench
+    if (!pipeline[0].argv.empty() && pipeline[0].argv[0]=="bench"){
+        last_status = bench_pipeline(pipeline, bg);
+        return;
+    }
+    // profile wraps the whole pipeline too
+    if (!pipeline[0].argv.empty() && pipeline[0].argv[0]=="profile"){
+        profile_pipeline(pipeline, bg, line);
+        return;
+    }
+    // workers needs the raw command line for `workers run -- ...`
+    if (!pipeline[0].argv.empty() && pipeline[0].argv[0]=="workers"){
+        workers_builtin(pipeline[0].argv, line);
+        remove_completed_jobs();
+        return;
+    }
+    // if single builtin and no redirections or pipes, run in shell
+    // (cache runs a command, so it always gets a job of its own)
+    if (pipeline.size()==1 && is_builtin(pipeline[0].argv) && pipeline[0].argv[0]!="cache" && pipeline[0].infile.empty() && pipeline[0].outfile.empty()){
+        int rc = run_builtin(pipeline[0].argv);
+        last_status = rc<0? 1 : rc & 0xff;
+        remove_completed_jobs();
+        return;
+    }
+    // launch pipeline
+    launch_pipeline(pipeline, bg, line);
+    remove_completed_jobs();
+}
+
+// ---- Record / replay ----
+// simpleshell --record FILE   logs every input line with its arrival time,
+//                             the cwd and environment changes before it
+// simpleshell --replay FILE [--fast]
+//                             runs a recording through execute_line at the
+//                             recorded pace (or back to back with --fast)
+//                             and reports per-command latency on stderr
+// The recording is line-oriented text: a header, then
+//   E <tab> NAME=VALUE     variable set or changed
+//   U <tab> NAME           variable removed
+//   D <tab> DIR            working directory
+//   C <tab> USEC <tab> LINE  input line, USEC after the start
+// with backslash, tab and newline escaped in the fields. Only variables in
+// RECORD_ENV_DEFAULT, SIMPLESHELL_* and those named in the colon-separated
+// SIMPLESHELL_RECORD_ENV are recorded, never the whole environment; the
+// file is created 0600 and not inherited by commands.
+
+static const char *RECORD_ENV_DEFAULT = "PATH:HOME:LANG:LC_ALL:LC_CTYPE:TERM:TZ:SHELL:USER";
+static int record_fd = -1;
+static chrono::steady_clock::time_point record_t0;
+static map<string, string> record_env;
+static string record_cwd;
+
+static string rec_escape(const string &s){
+    string o;
+    for (char c: s){
+        if (c=='\\') o += "\\\\";
+        else if (c=='\t') o += "\\t";
+        else if (c=='\n') o += "\\n";
+        else o += c;
+    }
+    return o;
+}
+
+static string rec_unescape(const string &s){
+    string o;
+    for (size_t i=0;i<s.size();++i){
+        if (s[i]!='\\' || i+1==s.size()){ o += s[i]; continue; }
+        char c = s[++i];
+        o += c=='t'? '\t' : c=='n'? '\n' : c;
+    }
+    return o;
+}
+
+static bool record_env_wanted(const string &name){
+    if (name.compare(0, 12, "SIMPLESHELL_")==0) return true;
+    const char *extra = getenv("SIMPLESHELL_RECORD_ENV");
+    string l = string(":")+RECORD_ENV_DEFAULT+":"+(extra? extra : "")+":";
+    return l.find(":"+name+":")!=string::npos;
+}
+
+static map<string, string> env_snapshot(){
+    map<string, string> m;
+    for (char **e=environ; *e; ++e){
+        const char *eq = strchr(*e, '=');
+        if (!eq) continue;
+        string name(*e, eq-*e);
+        if (record_env_wanted(name)) m[name] = eq+1;
+    }
+    return m;
+}
+
+bool record_open(const string &path){
+    record_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (record_fd<0){ perror(("--record: "+path).c_str()); return false; }
+    const char hdr[] = "#simpleshell-record 1\n";
+    write_all(record_fd, hdr, sizeof(hdr)-1);
+    record_t0 = chrono::steady_clock::now();
+    return true;
+}
+
+// exec-upgrade: carry the recording over (fd, elapsed time, last cwd).
+void record_save(ostream &o){
+    if (record_fd<0) return;
+    fcntl(record_fd, F_SETFD, 0);
+    long long us = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now()-record_t0).count();
+    o<<"record\t"<<record_fd<<"\t"<<us<<"\t"<<rec_escape(record_cwd)<<"\n";
+}
+
+void record_restore(istream &f){
+    long long us;
+    f>>record_fd>>us;
+    f.get();
+    string cwd;
+    getline(f, cwd);
+    record_cwd = rec_unescape(cwd);
+    fcntl(record_fd, F_SETFD, FD_CLOEXEC);
+    record_t0 = chrono::steady_clock::now()-chrono::microseconds(us);
+    record_env = env_snapshot();   // unchanged across the exec: no delta to write
+}
+
+void record_line(const string &line){
+    if (record_fd<0) return;
+    string out;
+    auto env = env_snapshot();
+    for (auto &e: env){
+        auto it = record_env.find(e.first);
+        if (it==record_env.end() || it->second!=e.second) out += "E\t"+rec_escape(e.first+"="+e.second)+"\n";
+    }
+    for (auto &e: record_env) if (!env.count(e.first)) out += "U\t"+rec_escape(e.first)+"\n";
+    record_env.swap(env);
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) && record_cwd!=cwd){ record_cwd = cwd; out += "D\t"+rec_escape(record_cwd)+"\n"; }
+    long long us = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now()-record_t0).count();
+    out += "C\t"+to_string(us)+"\t"+rec_escape(line)+"\n";
+    write_all(record_fd, out.data(), out.size());
+}
+
+int replay_main(const string &path, bool fast){
+    ifstream in(path);
+    string rec;
+    if (!in || !getline(in, rec) || rec!="#simpleshell-record 1"){ cerr<<"--replay: "<<path<<": not a recording\n"; return 1; }
+    struct Sample { double us; string line; };
+    vector<Sample> done;
+    auto t0 = chrono::steady_clock::now();
+    while (getline(in, rec)){
+        if (rec.size()<2 || rec[1]!='\t') continue;
+        string body = rec.substr(2);
+        if (rec[0]=='E'){
+            string kv = rec_unescape(body);
+            size_t eq = kv.find('=');
+            if (eq!=string::npos) setenv(kv.substr(0, eq).c_str(), kv.c_str()+eq+1, 1);
+        }
+        else if (rec[0]=='U') unsetenv(rec_unescape(body).c_str());
+        else if (rec[0]=='D'){ if (chdir(rec_unescape(body).c_str())<0) perror("--replay: cd"); else cwd_refresh(); }
+        else if (rec[0]=='C'){
+            size_t tab = body.find('\t');
+            if (tab==string::npos) continue;
+            long long at = atoll(body.c_str());
+            string line = rec_unescape(body.substr(tab+1));
+            if (!fast) this_thread::sleep_until(t0+chrono::microseconds(at));
+            if (trim(line)=="exit") break;
+            workers_poll();
+            journal_tick();
+            metrics_tick();
+            fr_record(FR_LINE, (int32_t)line.size(), 0);
+            ALLOC_LINE();
+            auto s = chrono::steady_clock::now();
+            execute_line(line);
+            cout<<flush;
+            if (!trim(line).empty()) done.push_back({ chrono::duration<double, micro>(chrono::steady_clock::now()-s).count(), trim(line) });
+        }
+    }
+    double wall = chrono::duration<double>(chrono::steady_clock::now()-t0).count();
+    if (done.empty()){ cerr<<"replay: no commands\n"; return 0; }
+    vector<double> lat;
+    double busy = 0;
+    for (auto &d: done){ lat.push_back(d.us); busy += d.us; }
+    sort(lat.begin(), lat.end());
+    auto pct = [&](double q){ return lat[min(lat.size()-1, (size_t)(q*lat.size()))]*1e3; };
+    char rate[64];
+    snprintf(rate, sizeof(rate), " (%.1f cmd/s, %.1f%% busy)\n", done.size()/wall, 100*busy/1e6/wall);
+    cerr<<"replay: "<<done.size()<<" commands in "<<fmt_ns(wall*1e9)<<rate;
+    cerr<<"  latency mean "<<fmt_ns(busy/done.size()*1e3)<<"  p50 "<<fmt_ns(pct(0.5))<<"  p90 "<<fmt_ns(pct(0.9))
+        <<"  p99 "<<fmt_ns(pct(0.99))<<"  max "<<fmt_ns(lat.back()*1e3)<<"\n";
+    sort(done.begin(), done.end(), [](const Sample &a, const Sample &b){ return a.us>b.us; });
+    cerr<<"  slowest:\n";
+    for (size_t k=0;k<done.size() && k<5;++k) cerr<<"    "<<fmt_ns(done[k].us*1e3)<<"  "<<done[k].line<<"\n";
+    return 0;
+}
+
+// ---- Parser scaling benchmark ----
+// simpleshell --bench-parse
+// Feeds split_tokens + parse_pipeline generated worst cases (one huge word,
+// megabyte lines of short words, 10k-stage pipelines, megabyte runs of
+// quoted segments, long operator and redirection runs) at sizes n, 2n, 4n,
+// 8n and reports time (thread CPU time, median of PARSE_REPS) and heap held
+// by the result. CPU time rather than wall time, and base sizes at which
+// even n takes a millisecond or more, keep timer resolution and a loaded
+// machine's preemption out of the fit. Exits 1 if any case grows
+// worse than linearly: the least-squares log-log slope over the four sizes
+// above 1.3 for time, or 1.1 for memory.
+
+struct ParseCase { const char *name; string unit; size_t base; };
+
+static const int PARSE_REPS = 7;
+
+static double thread_cpu_s(){
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec+ts.tv_nsec*1e-9;
+}
+
+// Least-squares slope of log y against log x.
+static double loglog_slope(const double *x, const double *y, int n){
+    double sx = 0, sy = 0, sxx = 0, sxy = 0;
+    for (int i=0;i<n;++i){
+        double lx = log(x[i]), ly = log(max(y[i], 1e-9));
+        sx += lx; sy += ly; sxx += lx*lx; sxy += lx*ly;
+    }
+    return (n*sxy-sx*sy)/(n*sxx-sx*sx);
+}
+
+static string parse_input(const string &unit, size_t n, bool close_stage){
+    string s;
+    s.reserve(unit.size()*n+4);
+    for (size_t i=0;i<n;++i) s += unit;
+    if (close_stage) s += "cat";
+    return s;
+}
+
+int bench_parse_main(){
+    const ParseCase cases[] = {
+        { "one long word",        "a",                    1<<17 },
+        { "many short words",     "ab ",                  1<<16 },
+        { "pipeline stages",      "cat | ",               5000 },
+        { "quoted segments",      "\"a quoted segment\" ", 1<<13 },
+        { "single-quoted words",  "'x' ",                 1<<14 },
+        { "pipe operator run",    "|",                    1<<15 },
+        { "append operator run",  ">>",                   1<<15 },
+        { "background markers",   "&",                    1<<15 },
+        { "redirections",         "> f ",                 1<<14 },
+    };
+    bool ok = true;
+    cout<<"case                  size_bytes   tokens   stages      time   heap_kb\n";
+    for (auto &c: cases){
+        double t[4], mem[4], len[4];
+        for (int step=0; step<4; ++step){
+            size_t n = c.base<<step;
+            string line = parse_input(c.unit, n, c.unit=="cat | ");
+            len[step] = (double)line.size();
+            vector<double> times;
+            size_t ntok = 0, nst = 0;
+            for (int rep=0; rep<PARSE_REPS; ++rep){
+                struct mallinfo2 m0 = mallinfo2();   // hblkhd: large blocks served by mmap
+                double t0 = thread_cpu_s();
+                auto toks = split_tokens(line);
+                auto parsed = parse_pipeline(toks);
+                times.push_back(thread_cpu_s()-t0);
+                struct mallinfo2 m1 = mallinfo2();
+                mem[step] = (double)(m1.uordblks+m1.hblkhd) - (double)(m0.uordblks+m0.hblkhd);
+                ntok = toks.size(); nst = parsed.first.size();
+            }
+            nth_element(times.begin(), times.begin()+PARSE_REPS/2, times.end());
+            t[step] = times[PARSE_REPS/2];
+            char l[160];
+            snprintf(l, sizeof(l), "%-20s %11zu %8zu %8zu %9s %9.0f\n", step? "" : c.name, line.size(), ntok, nst,
+                fmt_ns(t[step]*1e9).c_str(), mem[step]/1024);
+            cout<<l<<flush;
+        }
+        double kt = loglog_slope(len, t, 4);
+        double km = mem[0]>0 && mem[3]>0? loglog_slope(len, mem, 4) : 0;
+        bool bad = kt>1.3 || km>1.1;
+        char l[128];
+        snprintf(l, sizeof(l), "%-20s growth: time n^%.2f, memory n^%.2f%s\n", "", kt, km, bad? "  <-- worse than linear" : "");
+        cout<<l;
+        ok = ok && !bad;
+    }
+    cout<<(ok? "parse scaling: ok\n" : "parse scaling: FAILED\n");
+    return ok? 0 : 1;
+}
+
+// ---- PTY latency benchmark ----
+// simpleshell --bench-pty [iterations]
+// Starts this shell binary on a fresh pseudo-terminal (it gets a real
+// controlling tty, so tcsetpgrp/tcgetattr behave as interactively), types
+// scripted input and times what a user sees: startup to first prompt,
+// Enter to next prompt (empty line, builtin, external command), and
+// keystroke echo. Scenarios repeat with a few hundred background jobs in
+// the table and with a background job flooding the terminal. Headless;
+// prints one line per measurement.
+
+struct PtyShell {
+    int fd = -1;
+    pid_t pid = -1;
+    string buf;
+
+    bool start(){
+        fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+        if (fd<0 || grantpt(fd)<0 || unlockpt(fd)<0){ perror("--bench-pty: posix_openpt"); return false; }
+        string slave = ptsname(fd);
+        struct winsize ws = { 40, 120, 0, 0 };
+        ioctl(fd, TIOCSWINSZ, &ws);
+        pid = fork();
+        if (pid==0){
+            setsid();
+            int s = open(slave.c_str(), O_RDWR);
+            if (s<0) _exit(127);
+            ioctl(s, TIOCSCTTY, 0);
+            dup2(s, 0); dup2(s, 1); dup2(s, 2);
+            if (s>2) close(s);
+            setenv("SIMPLESHELL_JOURNAL", "off", 1);
+            execl("/proc/self/exe", "simpleshell", (char*)nullptr);
+            _exit(127);
+        }
+        return pid>0;
+    }
+
+    // Read until needle shows up (consuming through it); false on timeout.
+    bool wait_for(const string &needle, double timeout = 10){
+        auto end = chrono::steady_clock::now()+chrono::duration<double>(timeout);
+        while (true){
+            size_t at = buf.find(needle);
+            if (at!=string::npos){ buf.erase(0, at+needle.size()); return true; }
+            if (buf.size()>needle.size()) buf.erase(0, buf.size()-needle.size());   // floods: keep only a possible partial match
+            int ms = (int)chrono::duration_cast<chrono::milliseconds>(end-chrono::steady_clock::now()).count();
+            if (ms<=0) return false;
+            struct pollfd p = { fd, POLLIN, 0 };
+            if (poll(&p, 1, ms)<=0) continue;
+            char tmp[65536];
+            ssize_t n = read(fd, tmp, sizeof(tmp));
+            if (n<=0) return false;
+            buf.append(tmp, (size_t)n);
+        }
+    }
+
+    void drain(){ while (wait_for("\x01", 0.005)) {} buf.clear(); }
+
+    void send(const string &s){ write_all(fd, s.data(), s.size()); }
+
+    void stop(){
+        // the shell's jobs live in its session; take them down with it
+        if (DIR *d = opendir("/proc")){
+            while (struct dirent *e = readdir(d)){
+                pid_t p = atoi(e->d_name);
+                if (p>0 && p!=pid && getsid(p)==pid) kill(p, SIGKILL);
+            }
+            closedir(d);
+        }
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+        close(fd);
+    }
+};
+
+static const string PTY_PROMPT = "$ ";
+
+static void pty_report(const string &what, vector<double> &us){
+    if (us.empty()){ cout<<what<<": no samples (timed out)\n"; return; }
+    sort(us.begin(), us.end());
+    char line[160];
+    snprintf(line, sizeof(line), "%-34s n=%-4zu p50 %9s  p90 %9s  max %9s\n", what.c_str(), us.size(),
+        fmt_ns(us[us.size()/2]*1e3).c_str(), fmt_ns(us[us.size()*9/10]*1e3).c_str(), fmt_ns(us.back()*1e3).c_str());
+    cout<<line<<flush;
+}
+
+// Time Enter -> next prompt for line, n times.
+static void pty_prompt_latency(PtyShell &sh, const string &what, const string &line, int n){
+    vector<double> us;
+    for (int i=0;i<n;++i){
+        sh.drain();
+        auto t = chrono::steady_clock::now();
+        sh.send(line+"\n");
+        if (!sh.wait_for(PTY_PROMPT)) break;
+        us.push_back(chrono::duration<double, micro>(chrono::steady_clock::now()-t).count());
+    }
+    pty_report(what, us);
+}
+
+// Time each keystroke of line until it is echoed back, n times.
+static void pty_echo_latency(PtyShell &sh, const string &what, const string &line, int n){
+    vector<double> us;
+    for (int i=0;i<n;++i){
+        sh.drain();
+        for (char c: line){
+            auto t = chrono::steady_clock::now();
+            sh.send(string(1, c));
+            if (!sh.wait_for(string(1, c), 2)) break;
+            us.push_back(chrono::duration<double, micro>(chrono::steady_clock::now()-t).count());
+        }
+        sh.send("\n");
+        sh.wait_for(PTY_PROMPT);
+    }
+    pty_report(what, us);
+}
+
+int bench_pty_main(int n){
+    PtyShell sh;
+    auto t = chrono::steady_clock::now();
+    if (!sh.start()) return 1;
+    if (!sh.wait_for(PTY_PROMPT)){ cerr<<"--bench-pty: no prompt from the shell\n"; sh.stop(); return 1; }
+    vector<double> startup = { chrono::duration<double, micro>(chrono::steady_clock::now()-t).count() };
+    pty_report("startup to first prompt", startup);
+
+    pty_prompt_latency(sh, "prompt: empty line", "", n);
+    pty_prompt_latency(sh, "prompt: builtin (cd .)", "cd .", n);
+    pty_prompt_latency(sh, "prompt: external (true)", "true", n);
+    pty_echo_latency(sh, "echo: keystroke", "echo hi", n/5+1);
+
+    const int jobs_n = 300;
+    for (int i=0;i<jobs_n;++i){ sh.send("sleep 600 &\n"); sh.wait_for(PTY_PROMPT); }
+    pty_prompt_latency(sh, "prompt: empty line, 300 jobs", "", n);
+    pty_prompt_latency(sh, "prompt: external, 300 jobs", "true", n);
+
+    sh.send("yes &\n");
+    sh.wait_for(PTY_PROMPT);
+    pty_prompt_latency(sh, "prompt: empty line, output flood", "", n);
+    pty_prompt_latency(sh, "prompt: external, output flood", "true", n);
+    pty_echo_latency(sh, "echo: keystroke, output flood", "echo hi", n/5+1);
+    sh.stop();
+    return 0;
+}
+
+// ---- Signal handlers ----
+void sigchld_handler(int sig){
+    // Reap children; update job statuses
+    int saved_errno = errno;
+    while (true){
+        int status;
+        pid_t pid = waitpid(-1, &status, WNOHANG | WUNTRACED | WCONTINUED);
+        if (pid<=0) break;
+        // the pid is gone once reaped, so match it against the jobs' stage pids
+        job_update(pid, status);
+    }
+    errno = saved_errno;
+}
+
+void sigint_handler(int sig){
+    got_sigint = 1;
+    // forward SIGINT to foreground process group
+    pid_t fg = tcgetpgrp(STDIN_FILENO);
+    if (fg!=shell_pgid){ kill(-fg, SIGINT); }
+}
+
+void sigtstp_handler(int sig){
+    pid_t fg = tcgetpgrp(STDIN_FILENO);
+    if (fg!=shell_pgid){ kill(-fg, SIGTSTP); }
+}
+
+int main(int argc, char **argv){
+    // session client/server and benchmark modes
+    string replay;
+    bool replay_fast = false;
+    if (argc>1){
+        string opt = argv[1];
+        if (opt=="-l" || ((opt=="-S" || opt=="-A") && argc>2)) return session_main(opt, argc>2? argv[2] : "");
+        if (opt=="--bench-spawn") return bench_spawn_main(argc>2? max(1, atoi(argv[2])) : 1024, argc>3? max(1, atoi(argv[3])) : 200);
+        if (opt=="--bench-pty") return bench_pty_main(argc>2? max(1, atoi(argv[2])) : 50);
+        if (opt=="--bench-parse") return bench_parse_main();
+        if (opt=="--record" && argc==3){ if (!record_open(argv[2])) return 1; }
+        else if (opt=="--replay" && (argc==3 || (argc==4 && string(argv[3])=="--fast"))){ replay = argv[2]; replay_fast = argc==4; }
+        else {
+            cerr<<"usage: simpleshell [-S name | -A name | -l | --record file | --replay file [--fast] | --bench-spawn [max_mb] [runs] | --bench-pty [n] | --bench-parse]\n";
+            return 2;
+        }
+    }
+
+    // initialize shell process group and terminal
     shell_pgid = getpid();
-    if (setpgid(shell_pgid, shell_pgid) < 0) perror("setpgid");
+    if (getpgrp()!=shell_pgid && setpgid(shell_pgid, shell_pgid) < 0) perror("setpgid");
     tcgetattr(STDIN_FILENO, &shell_tmodes);
     tcsetpgrp(STDIN_FILENO, shell_pgid);
 
@@ -359,31 +5097,43 @@ int main(){
 
     signal(SIGINT, sigint_handler);
     signal(SIGTSTP, sigtstp_handler);
+    // taking the terminal back with tcsetpgrp from the background would stop us
+    signal(SIGTTOU, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+
+    char exe[PATH_MAX];
+    ssize_t exe_len = readlink("/proc/self/exe", exe, sizeof(exe)-1);
+    if (exe_len>0) shell_exe.assign(exe, (size_t)exe_len);
+    stats_init();
+    allocstat_init();
+    fr_init();
+    upgrade_restore();
+    journal_open();
+    // exec-upgrade execs with SIGCHLD blocked; reap what exited meanwhile
+    reap_children();
+    sigset_t none; sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, nullptr);
+    if (!replay.empty()) return replay_main(replay, replay_fast);
 
     string line;
     while (true){
-        // print prompt
-        char cwd[1024]; getcwd(cwd, sizeof(cwd));
-        cout << "simple-shell:" << cwd << "$ ";
-        if (!getline(cin, line)) break;
-        line = trim(line);
-        if (line.empty()) continue;
-        // tokenise
-        auto toks = split_tokens(line);
-        auto parsed = parse_pipeline(toks);
-        auto pipeline = parsed.first; bool bg = parsed.second;
-        if (pipeline.empty()) continue;
-        // if single builtin and no redirections or pipes, run in shell
-        if (pipeline.size()==1 && is_builtin(pipeline[0].argv) && pipeline[0].infile.empty() && pipeline[0].outfile.empty()){
-            run_builtin(pipeline[0].argv);
-            remove_completed_jobs();
-            continue;
-        }
-        // launch pipeline
-        launch_pipeline(pipeline, bg, line);
-        remove_completed_jobs();
+        workers_poll();
+        journal_tick();
+        metrics_tick();
+        prompt_show();
+        if (!upgrade_getline(line)) break;
+        prompt_done();
+        fr_record(FR_LINE, (int32_t)line.size(), 0);
+        ALLOC_LINE();
+        record_line(line);
+        auto t0 = chrono::steady_clock::now();
+        execute_line(line);
+        last_duration_ns = chrono::duration<double, nano>(chrono::steady_clock::now()-t0).count();
     }
 
+    coalesce_stop();
+    metrics_shutdown();
+    prompt_stop();
     cout << "\nExiting shell.\n";
     return 0;
 }
@@ -392,10 +5142,12 @@ int main(){
 README / Usage
 ---------------
 Compile:
-  g++ -std=c++17 -O2 -o simpleshell LinuxShell_Assignment2.cpp
+  g++ -std=c++17 -O2 -pthread -o simpleshell LinuxShell_Assignment2.cpp
 
 Run:
   ./simpleshell
+  ./simpleshell -S work   # attach to (or start) detachable session "work"
+  ./simpleshell -A work   # re-attach; Ctrl-] detaches, -l lists sessions
 
 Features supported:
 - External commands with arguments (ls -l /tmp)
@@ -404,6 +5156,93 @@ Features supported:
 - Redirection: command < infile, command > outfile, command >> outfile
 - Job control: jobs, fg %1, bg %1
 - Built-ins: cd, exit
+- JSON lines: jsonl [-j] [-P threads] [-w path=value]... path... < logs.jsonl
+  (prints the selected fields as TSV, or JSON objects with -j)
+- Shared-memory pipes: SIMPLESHELL_RING_CMDS=jsonl:mytool ./simpleshell
+  gives listed neighbours a memfd ring (SIMPLESHELL_RING_IN_FD/OUT_FD) in
+  addition to the normal pipe; SIMPLESHELL_RING_SIZE sets its capacity.
+- Records: rec select f... | where f op v | sum|min|max|avg f | count [f]
+  over TSV-with-header input (jsonl -H ...). After `set -o structured`,
+  jsonl/rec stages hand each other typed columnar batches instead of text.
+- Memoization: cache [-m] [-e VAR]... -- cmd args < input replays stored
+  stdout and exit status when argv, cwd, PATH/-e vars, the executable and
+  the inputs are unchanged (store: $SIMPLESHELL_CACHE_DIR). Typed at the
+  prompt, the command gets empty input instead of the terminal. External
+  commands only.
+- Task DAGs: tasks [-f Tasksfile] [-j N] [-c] [-B] [-n] [target...] runs
+  [name] sections (deps/in/out/run keys) in parallel, skipping up-to-date
+  ones and starting the longest remaining path first.
+- Watch mode: watch [-p pattern]... [-d ms] [-q] -- cmd | cmd2 re-runs the
+  pipeline on matching file changes (restarting it, or queueing with -q);
+  a pattern is a directory, a dir + basename glob, or dir + "**" for a tree.
+  A restart sends SIGTERM and, 2s later, SIGKILL. watch cannot take a trailing &.
+- Worker pool: workers start N [-s slots] [-a] [-c]; workers run -- cmdline;
+  workers status; workers stop. Pool jobs show up in `jobs`.
+- Job journal: job state is journaled to a mmap'd file per terminal
+  (SIMPLESHELL_JOURNAL=path|off); after a crash the next shell on that
+  terminal re-adopts jobs that are still running (tracked via pidfds).
+- Live upgrade: exec-upgrade [path] re-executes the (rebuilt) shell binary
+  in place; running jobs, workers, options, terminal modes, the journal,
+  stats histograms, the flight recorder, a --record recording, coalesced
+  job output, $? and unread script input carry over. Not carried: a
+  running shellprof (exec-upgrade refuses until shellprof stop), the
+  prompt's cwd/branch caches and {duration} (refilled on the next prompt),
+  and allocstat counters (restart from zero).
+- Latency stats: stats prints count/mean/p50/p90/p99/max for parse, argv
+  build (expand), fork-to-exec, exec-to-exit and terminal handoff; stats -r
+  also resets them.
+- Metrics: metrics file /var/lib/node_exporter/shell.prom 15 rewrites the
+  file atomically every 15s; metrics socket /tmp/shell.sock serves the same
+  text per connection; metrics off stops, bare metrics prints it.
+- Flight recorder: flightrec prints the last 4096 events (seconds since
+  start, event, arguments); flightrec -c clears. kill -QUIT <shell pid> or
+  a crash writes them to flightrec-<pid> in the runtime directory.
+- USDT probes (built in when sys/sdt.h is installed): simpleshell:
+  tokenize__start/done, parse__start/done, spawn, exec, exec__fail, reap,
+  job__state, e.g. bpftrace -e 'usdt:./simpleshell:simpleshell:spawn
+  { printf("%d\n", arg0); }' -p <shell pid>
+- Pipeline profiling: jobs --profile %1 [seconds] samples each stage's
+  state, wchan, CPU and input rate plus inter-stage pipe fill, and names
+  the limiting stage (CPU-bound or waiting outside the pipeline).
+- Sampling profiler: profile -F 999 -o out.folded -- gzip -9 < big | wc -c
+  samples each stage with perf_event_open and writes folded stacks for
+  flamegraph.pl (stage name as the root frame, kernel frames marked _[k]).
+- Self profiling: shellprof start [-F hz], run a script, shellprof stop
+  [-o file] writes the shell's own folded stacks and lists hot functions.
+- Allocation stats: build with -DSIMPLESHELL_ALLOCSTAT, then allocstat
+  shows allocations/bytes/frees for tokenize, parse, argv build and the job
+  table (plus allocations per input line); allocstat -r resets.
+- Benchmarking: bench -w 3 -n 50 -p "sync" -- grep foo big.txt | wc -l
+  reports mean/sd, range, p50/p90/p99, user/system time and max RSS.
+- Spawn scaling: ./simpleshell --bench-spawn 1024 200 > spawn.csv times
+  launching /bin/true (fork as the shell does, and posix_spawn) while the
+  heap grows from 1 MB to 1 GB. Exits 1 if fork latency grows faster than
+  linearly with RSS or starts above 3x posix_spawn's.
+- Record/replay: ./simpleshell --record session.rec logs input lines with
+  timing, cwd and changes to a few environment variables (PATH, HOME, locale,
+  TERM, TZ, SHELL, USER, SIMPLESHELL_*, plus any listed in the colon-separated
+  SIMPLESHELL_RECORD_ENV); the file is mode 0600. ./simpleshell --replay session.rec
+  [--fast] re-runs them (at the recorded pace unless --fast) and prints
+  throughput, latency percentiles and the slowest commands.
+- Interactive latency: ./simpleshell --bench-pty 50 drives a copy of the
+  shell on a pty and reports Enter-to-prompt and keystroke echo latency,
+  also with 300 background jobs and under a background output flood.
+- Parser scaling: ./simpleshell --bench-parse times tokenizing and parsing
+  generated worst cases at 4 sizes and exits 1 on worse-than-linear growth.
+- Prompt: SIMPLESHELL_PROMPT='{user}@{host}:{dir} ({branch}) [{status} {duration}]$ '
+  sets the prompt (default 'simple-shell:{cwd}$ '). Segments: cwd, dir, user,
+  host, jobs, status, duration, branch. The git/hg branch is looked up on a
+  worker thread; if it is late it appears in the next prompt (or is drawn in
+  place when input is not an interactive terminal).
+- Coalesced output: after set -o coalesce, background jobs' stdout/stderr go
+  through the shell, which prints whole lines as "[job] text" in batches
+  (at most 20 per second). At an interactive prompt output is held until
+  the line is submitted, so typing is never overwritten; jobs keep running
+  meanwhile, and lines beyond 64 KiB of held output are dropped with a
+  count printed when it goes out. fg passes a job's
+  output through unprefixed (it still is not a terminal; fg warns). Output
+  redirected to a file is unaffected; set +o coalesce applies to jobs
+  started afterwards.
 
 Day-wise tasks mapping (as requested):
 Day 1: Plan and parse input. Tokenizer (split_tokens) and parse_pipeline implemented.